@@ -0,0 +1,147 @@
+/*
+Batch benchmark runner: steps a batch of headless machines with zx48k_batch_step and writes the throughput as JSON to
+stdout, in machine frames per second.
+
+    zx48k_batch_bench [-n envs] [-t threads] [-f frames] [-b small|none|full] [-m pixels|display|ink|attrs] [file.z80]
+
+Without a file the machines boot the ROM. Threads default to one per CPU, running with -t 1 and then with more threads
+shows how the batch scales. -b sets the border of the observations, none skips decoding the border. -m sets what the
+observations are, the frames or one of the compact forms read from the display RAM.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zx48k.h"
+#include "json.h"
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void* bench_load(char const* const path, size_t* const size) {
+    FILE* const file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    void* data = NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long const length = ftell(file);
+
+        if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = malloc(length);
+
+            if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+                free(data);
+                data = NULL;
+            }
+
+            *size = length;
+        }
+    }
+
+    fclose(file);
+    return data;
+}
+
+int main(int const argc, char const* const argv[]) {
+    unsigned long envs = 64;
+    unsigned long threads = 0;
+    unsigned long frames = 100;
+    zx48k_border_t border = ZX48K_BORDER_SMALL;
+    zx48k_observation_t observation = ZX48K_OBSERVATION_PIXELS;
+    char const* path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            envs = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            i++;
+            border = !strcmp(argv[i], "none") ? ZX48K_BORDER_NONE : !strcmp(argv[i], "full") ? ZX48K_BORDER_FULL : ZX48K_BORDER_SMALL;
+        }
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            i++;
+            observation = !strcmp(argv[i], "display") ? ZX48K_OBSERVATION_DISPLAY
+                        : !strcmp(argv[i], "ink") ? ZX48K_OBSERVATION_INK_PLANE
+                        : !strcmp(argv[i], "attrs") ? ZX48K_OBSERVATION_ATTRS
+                        : ZX48K_OBSERVATION_PIXELS;
+        }
+        else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-n envs] [-t threads] [-f frames] [-b small|none|full] [-m pixels|display|ink|attrs] [file.z80]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    void* data = NULL;
+    size_t size = 0;
+
+    if (path != NULL) {
+        data = bench_load(path, &size);
+
+        if (data == NULL) {
+            fprintf(stderr, "Error loading \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    zx48k_batch_t* const batch = zx48k_batch_create(envs, threads);
+
+    if (batch == NULL || !zx48k_batch_set_border(batch, border) || !zx48k_batch_set_observation(batch, observation)) {
+        fprintf(stderr, "Error creating a batch of %lu machines\n", envs);
+        return EXIT_FAILURE;
+    }
+
+    /* Each machine gets a different input so they don't all do the same work */
+    zx48k_input_t* const inputs = (zx48k_input_t*)calloc(envs, sizeof(*inputs));
+
+    for (unsigned long i = 0; i < envs; i++) {
+        if (data != NULL && !zx48k_load(zx48k_batch_get(batch, i), data, size)) {
+            fprintf(stderr, "Error running \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+
+        inputs[i].key_states = (uint64_t)1 << (i % 40);
+    }
+
+    uint64_t const t0 = bench_now();
+
+    for (unsigned long i = 0; i < frames; i++) {
+        zx48k_batch_step(batch, inputs);
+    }
+
+    double const seconds = (bench_now() - t0) / 1e9;
+
+    printf("{\n");
+    printf("  \"file\": ");
+    bench_print_string(path);
+    printf(",\n");
+    printf("  \"envs\": %lu,\n", envs);
+    printf("  \"threads\": %lu,\n", threads);
+    printf("  \"frames\": %lu,\n", frames);
+    printf("  \"observation_size\": %zu,\n", zx48k_batch_observation_size(batch));
+    printf("  \"seconds\": %.6f,\n", seconds);
+    printf("  \"env_fps\": %.2f\n", envs * frames / seconds);
+    printf("}\n");
+
+    zx48k_batch_destroy(batch);
+    free(inputs);
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+/*
+Headless benchmark runner: links the core with a minimal in-process frontend (no-op video, audio and input callbacks),
+runs a number of frames as fast as possible and writes the results as JSON to stdout.
+
+    zx48k_bench [-f frames] [-x hash] [-F] [-o key=value]... [file.z80]
+
+Without a file the core boots the ROM. The output includes a 64-bit FNV-1a hash of the last frame presented, when an
+expected hash is given with -x the runner fails if the last frame doesn't match it.
+
+-F makes the frontend report that it's fast-forwarding, except on the last frame so it still gets hashed. -o sets a core
+option.
+
+On Linux the output also has the L1 data cache read misses per frame, measured with perf_event_open. They're null when
+the counter isn't available, e.g. when kernel.perf_event_paranoid doesn't allow it.
+*/
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "libretro.h"
+#include "zx48k.h"
+#include "json.h"
+
+static retro_get_proc_address_t get_proc_address;
+static bool hash_frame;
+static bool fast_forward;
+static char const* options[16];
+static unsigned num_options;
+static uint64_t frame_hash;
+static unsigned pixel_size = 4;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+/* Opens a counter of L1 data cache read misses for this thread, returns -1 if not available */
+static int bench_open_l1_misses(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void bench_log(enum retro_log_level const level, char const* const fmt, ...) {
+    if (level >= RETRO_LOG_WARN) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+}
+
+static bool bench_environment(unsigned const cmd, void* const data) {
+    switch (cmd) {
+        case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
+            ((struct retro_log_callback*)data)->log = bench_log;
+            return true;
+
+        case RETRO_ENVIRONMENT_SET_PROC_ADDRESS_CALLBACK:
+            get_proc_address = ((struct retro_get_proc_address_interface const*)data)->get_proc_address;
+            return true;
+
+        case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+            *(bool*)data = true;
+            return true;
+
+        case RETRO_ENVIRONMENT_GET_FASTFORWARDING:
+            *(bool*)data = fast_forward && !hash_frame;
+            return true;
+
+        case RETRO_ENVIRONMENT_GET_VARIABLE: {
+            struct retro_variable* const var = (struct retro_variable*)data;
+            size_t const length = strlen(var->key);
+
+            for (unsigned i = 0; i < num_options; i++) {
+                if (!strncmp(options[i], var->key, length) && options[i][length] == '=') {
+                    var->value = options[i] + length + 1;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
+            pixel_size = *(enum retro_pixel_format const*)data == RETRO_PIXEL_FORMAT_RGB565 ? 2 : 4;
+            return true;
+
+        case RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME:
+        case RETRO_ENVIRONMENT_SET_VARIABLES:
+        case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+            return true;
+    }
+
+    return false;
+}
+
+static void bench_video(void const* const data, unsigned const width, unsigned const height, size_t const pitch) {
+    if (!hash_frame || data == NULL) {
+        return;
+    }
+
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (unsigned y = 0; y < height; y++) {
+        uint8_t const* const line = (uint8_t const*)data + y * pitch;
+
+        for (size_t x = 0; x < width * pixel_size; x++) {
+            hash = (hash ^ line[x]) * UINT64_C(0x100000001b3);
+        }
+    }
+
+    frame_hash = hash;
+}
+
+static size_t bench_audio(int16_t const* const data, size_t const frames) {
+    (void)data;
+    return frames;
+}
+
+static void bench_input_poll(void) {}
+
+static int16_t bench_input_state(unsigned const port, unsigned const device, unsigned const index, unsigned const id) {
+    (void)port;
+    (void)device;
+    (void)index;
+    (void)id;
+    return 0;
+}
+
+static void* bench_load(char const* const path, size_t* const size) {
+    FILE* const file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    void* data = NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long const length = ftell(file);
+
+        if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = malloc(length);
+
+            if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+                free(data);
+                data = NULL;
+            }
+
+            *size = length;
+        }
+    }
+
+    fclose(file);
+    return data;
+}
+
+int main(int const argc, char const* const argv[]) {
+    unsigned long frames = 3000;
+    char const* path = NULL;
+    char const* expected_hash = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+            expected_hash = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc && num_options < sizeof(options) / sizeof(options[0])) {
+            options[num_options++] = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-F")) {
+            fast_forward = true;
+        }
+        else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-f frames] [-x hash] [-F] [-o key=value]... [file.z80]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct retro_game_info info = {path, NULL, 0, NULL};
+
+    if (path != NULL) {
+        info.data = bench_load(path, &info.size);
+
+        if (info.data == NULL) {
+            fprintf(stderr, "Error loading \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    retro_set_environment(bench_environment);
+    retro_set_video_refresh(bench_video);
+    retro_set_audio_sample_batch(bench_audio);
+    retro_set_input_poll(bench_input_poll);
+    retro_set_input_state(bench_input_state);
+    retro_init();
+
+    if (!retro_load_game(&info)) {
+        fprintf(stderr, "Error running \"%s\"\n", path);
+        return EXIT_FAILURE;
+    }
+
+    zx48k_get_stats_t const get_stats = get_proc_address != NULL ? (zx48k_get_stats_t)get_proc_address("zx48k_get_stats") : NULL;
+    zx48k_stats_t const* const stats = get_stats != NULL ? get_stats() : NULL;
+
+    if (stats == NULL) {
+        fprintf(stderr, "The core was not compiled with ZX48K_STATS\n");
+        return EXIT_FAILURE;
+    }
+
+    int const l1_fd = bench_open_l1_misses();
+    uint64_t l1_misses = 0;
+
+#ifdef __linux__
+    if (l1_fd >= 0) {
+        ioctl(l1_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(l1_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+
+    zx48k_counters_t const before = stats->total;
+    uint64_t const t0 = bench_now();
+
+    for (unsigned long i = 0; i < frames; i++) {
+        hash_frame = i == frames - 1;
+        retro_run();
+    }
+
+    uint64_t const elapsed_ns = bench_now() - t0;
+
+#ifdef __linux__
+    if (l1_fd >= 0) {
+        ioctl(l1_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(l1_fd, &l1_misses, sizeof(l1_misses)) != sizeof(l1_misses)) {
+            l1_misses = 0;
+        }
+
+        close(l1_fd);
+    }
+#endif
+
+    double const seconds = elapsed_ns / 1e9;
+    zx48k_counters_t const* const total = &stats->total;
+
+    printf("{\n");
+    printf("  \"file\": ");
+    bench_print_string(path);
+    printf(",\n");
+    printf("  \"frames\": %" PRIu64 ",\n", total->frames - before.frames);
+    printf("  \"seconds\": %.6f,\n", seconds);
+    printf("  \"fps\": %.2f,\n", (total->frames - before.frames) / seconds);
+    printf("  \"mhz\": %.3f,\n", (total->ticks - before.ticks) / seconds / 1e6);
+    printf("  \"ticks\": %" PRIu64 ",\n", total->ticks - before.ticks);
+    printf("  \"instructions\": %" PRIu64 ",\n", total->instructions - before.instructions);
+    printf("  \"mem_reads\": %" PRIu64 ",\n", total->mem_reads - before.mem_reads);
+    printf("  \"mem_writes\": %" PRIu64 ",\n", total->mem_writes - before.mem_writes);
+    printf("  \"io_cycles\": %" PRIu64 ",\n", total->io_cycles - before.io_cycles);
+    printf("  \"wait_states\": %" PRIu64 ",\n", total->wait_states - before.wait_states);
+    printf("  \"tick_callbacks\": %" PRIu64 ",\n", total->tick_callbacks - before.tick_callbacks);
+    printf("  \"audio_callbacks\": %" PRIu64 ",\n", total->audio_callbacks - before.audio_callbacks);
+    printf("  \"scanlines\": %" PRIu64 ",\n", total->scanlines - before.scanlines);
+    printf("  \"cpu_ns\": %" PRIu64 ",\n", total->cpu_ns - before.cpu_ns);
+    printf("  \"video_ns\": %" PRIu64 ",\n", total->video_ns - before.video_ns);
+    printf("  \"audio_ns\": %" PRIu64 ",\n", total->audio_ns - before.audio_ns);
+
+    if (l1_fd >= 0 && frames != 0) {
+        printf("  \"l1d_misses_per_frame\": %.1f,\n", (double)l1_misses / frames);
+    }
+    else {
+        printf("  \"l1d_misses_per_frame\": null,\n");
+    }
+
+    printf("  \"frame_hash\": \"%016" PRIx64 "\"\n", frame_hash);
+    printf("}\n");
+
+    int result = EXIT_SUCCESS;
+
+    if (expected_hash != NULL && strtoull(expected_hash, NULL, 16) != frame_hash) {
+        fprintf(stderr, "\"%s\": frame hash %016" PRIx64 " doesn't match the expected %s\n", path != NULL ? path : "", frame_hash, expected_hash);
+        result = EXIT_FAILURE;
+    }
+
+    retro_unload_game();
+    retro_deinit();
+    free((void*)info.data);
+    return result;
+}
@@ -0,0 +1,268 @@
+/*
+Golden hash checker: links the core with a minimal in-process frontend, runs a number of frames and writes the hashes of
+the frames, the audio and the machine state as a line of the golden hash manifest:
+
+    zx48k_check [-f frames] [-x frame,audio,state] [-v] [-o key=value]... [file.z80]
+
+    name frames frame audio state
+
+Each hash chains the hashes the core returns through zx48k_get_hashes after every frame, so a change in any frame
+changes it. When the expected hashes are given with -x the checker fails if any of them doesn't match. -v also writes
+the hashes of every frame, to find the first frame that differs by diffing the output of two builds. -o sets a core
+option, the hashes don't depend on the pixel format or the render thread but the frame hash covers only the border
+decoded for zx48k_border.
+
+The frame hash is computed from the display RAM and the border colors and the state hash reads the RAM and registers in
+the host byte order, so the golden hashes only hold on little-endian hosts.
+*/
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libretro.h"
+#include "zx48k.h"
+
+static retro_get_proc_address_t get_proc_address;
+static char const* options[16];
+static unsigned num_options;
+
+static void check_log(enum retro_log_level const level, char const* const fmt, ...) {
+    if (level >= RETRO_LOG_WARN) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+}
+
+static bool check_environment(unsigned const cmd, void* const data) {
+    switch (cmd) {
+        case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
+            ((struct retro_log_callback*)data)->log = check_log;
+            return true;
+
+        case RETRO_ENVIRONMENT_SET_PROC_ADDRESS_CALLBACK:
+            get_proc_address = ((struct retro_get_proc_address_interface const*)data)->get_proc_address;
+            return true;
+
+        case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+            *(bool*)data = true;
+            return true;
+
+        case RETRO_ENVIRONMENT_GET_VARIABLE: {
+            struct retro_variable* const var = (struct retro_variable*)data;
+            size_t const length = strlen(var->key);
+
+            for (unsigned i = 0; i < num_options; i++) {
+                if (!strncmp(options[i], var->key, length) && options[i][length] == '=') {
+                    var->value = options[i] + length + 1;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
+        case RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME:
+        case RETRO_ENVIRONMENT_SET_VARIABLES:
+        case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+        case RETRO_ENVIRONMENT_SET_GEOMETRY:
+            return true;
+    }
+
+    return false;
+}
+
+static void check_video(void const* const data, unsigned const width, unsigned const height, size_t const pitch) {
+    (void)data;
+    (void)width;
+    (void)height;
+    (void)pitch;
+}
+
+static size_t check_audio(int16_t const* const data, size_t const frames) {
+    (void)data;
+    return frames;
+}
+
+static void check_input_poll(void) {}
+
+static int16_t check_input_state(unsigned const port, unsigned const device, unsigned const index, unsigned const id) {
+    (void)port;
+    (void)device;
+    (void)index;
+    (void)id;
+    return 0;
+}
+
+static void* check_load(char const* const path, size_t* const size) {
+    FILE* const file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    void* data = NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long const length = ftell(file);
+
+        if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = malloc(length);
+
+            if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+                free(data);
+                data = NULL;
+            }
+
+            *size = length;
+        }
+    }
+
+    fclose(file);
+    return data;
+}
+
+/* Folds a 64-bit hash into a running hash with FNV-1a, least significant byte first */
+static uint64_t check_chain(uint64_t hash, uint64_t const value) {
+    for (unsigned i = 0; i < 64; i += 8) {
+        hash = (hash ^ ((value >> i) & 0xff)) * UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+/* Writes the file name without its directory and extension, "rom" without a file */
+static void check_print_name(char const* const path) {
+    if (path == NULL) {
+        printf("rom");
+        return;
+    }
+
+    char const* const slash = strrchr(path, '/');
+    char const* const name = slash != NULL ? slash + 1 : path;
+    char const* const dot = strrchr(name, '.');
+
+    printf("%.*s", (int)(dot != NULL ? (size_t)(dot - name) : strlen(name)), name);
+}
+
+int main(int const argc, char const* const argv[]) {
+    unsigned long frames = 500;
+    char const* path = NULL;
+    char const* expected = NULL;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+            expected = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc && num_options < sizeof(options) / sizeof(options[0])) {
+            options[num_options++] = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        }
+        else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-f frames] [-x frame,audio,state] [-v] [-o key=value]... [file.z80]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    zx48k_hashes_t golden;
+
+    if (expected != NULL) {
+        char* end = NULL;
+        golden.frame = strtoull(expected, &end, 16);
+        golden.audio = *end == ',' ? strtoull(end + 1, &end, 16) : 0;
+        golden.state = *end == ',' ? strtoull(end + 1, &end, 16) : 0;
+
+        if (*end != 0) {
+            fprintf(stderr, "The expected hashes must be three hexadecimal numbers separated by commas\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct retro_game_info info = {path, NULL, 0, NULL};
+
+    if (path != NULL) {
+        info.data = check_load(path, &info.size);
+
+        if (info.data == NULL) {
+            fprintf(stderr, "Error loading \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    retro_set_environment(check_environment);
+    retro_set_video_refresh(check_video);
+    retro_set_audio_sample_batch(check_audio);
+    retro_set_input_poll(check_input_poll);
+    retro_set_input_state(check_input_state);
+    retro_init();
+
+    if (!retro_load_game(&info)) {
+        fprintf(stderr, "Error running \"%s\"\n", path);
+        return EXIT_FAILURE;
+    }
+
+    zx48k_get_hashes_t const get_hashes = get_proc_address != NULL ? (zx48k_get_hashes_t)get_proc_address("zx48k_get_hashes") : NULL;
+
+    if (get_hashes == NULL) {
+        fprintf(stderr, "The core doesn't export zx48k_get_hashes\n");
+        return EXIT_FAILURE;
+    }
+
+    zx48k_hashes_t total = {
+        UINT64_C(0xcbf29ce484222325), UINT64_C(0xcbf29ce484222325), UINT64_C(0xcbf29ce484222325)
+    };
+
+    for (unsigned long i = 0; i < frames; i++) {
+        retro_run();
+
+        zx48k_hashes_t hashes;
+        get_hashes(&hashes);
+
+        total.frame = check_chain(total.frame, hashes.frame);
+        total.audio = check_chain(total.audio, hashes.audio);
+        total.state = check_chain(total.state, hashes.state);
+
+        if (verbose) {
+            printf("%lu %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n", i, hashes.frame, hashes.audio, hashes.state);
+        }
+    }
+
+    check_print_name(path);
+    printf(" %lu %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n", frames, total.frame, total.audio, total.state);
+
+    int result = EXIT_SUCCESS;
+
+    if (expected != NULL) {
+        static char const* const names[3] = {"frame", "audio", "state"};
+        uint64_t const actual[3] = {total.frame, total.audio, total.state};
+        uint64_t const wanted[3] = {golden.frame, golden.audio, golden.state};
+
+        for (int i = 0; i < 3; i++) {
+            if (actual[i] != wanted[i]) {
+                fprintf(stderr, "\"%s\": %s hash %016" PRIx64 " doesn't match the golden %016" PRIx64 "\n",
+                        path != NULL ? path : "", names[i], actual[i], wanted[i]);
+
+                result = EXIT_FAILURE;
+            }
+        }
+    }
+
+    retro_unload_game();
+    retro_deinit();
+    free((void*)info.data);
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_JSON_H__
+#define BENCH_JSON_H__
+
+/*
+Helpers shared by the benchmark runners to write their results as JSON.
+*/
+
+#include <stdio.h>
+
+/* Writes s as a quoted JSON string, escaping the characters JSON doesn't allow in strings, an empty string if NULL */
+static void bench_print_string(char const* s) {
+    putchar('"');
+
+    for (; s != NULL && *s != 0; s++) {
+        unsigned char const c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20) {
+            printf("\\u%04x", c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+
+    putchar('"');
+}
+
+#endif /* BENCH_JSON_H__ */
@@ -0,0 +1,221 @@
+/*
+Lock-step benchmark: runs the same set of machines once with zx_exec on each machine and once with the experimental
+zx_lockstep_exec, and writes the throughput of both as JSON to stdout, in machine frames per second.
+
+    zx48k_lockstep_bench [-n machines] [-f frames] [file.z80]
+
+Every machine presses a different key, so programs that read the keyboard diverge. Both runs must end with the same RAM,
+CPU registers and frames, otherwise the runner fails.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHIPS_IMPL
+#include "ay38910.h"
+#include "beeper.h"
+#include "clk.h"
+#include "kbd.h"
+#include "mem.h"
+#include "z80.h"
+#include "zx.h"
+#include "zx_lockstep.h"
+#include "rom.h"
+#include "json.h"
+
+#define US_PER_FRAME 20000
+
+typedef struct {
+    zx_t zx;
+    uint8_t ram[3][0x4000];
+    uint32_t pixel_buffer[320 * 256];
+}
+machine_t;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void* bench_load(char const* const path, size_t* const size) {
+    FILE* const file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    void* data = NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long const length = ftell(file);
+
+        if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = malloc(length);
+
+            if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+                free(data);
+                data = NULL;
+            }
+
+            *size = length;
+        }
+    }
+
+    fclose(file);
+    return data;
+}
+
+static machine_t* create_machines(unsigned const count, void const* const data, size_t const size) {
+    machine_t* const machines = (machine_t*)aligned_alloc(_Alignof(machine_t), count * sizeof(*machines));
+
+    if (machines == NULL) {
+        return NULL;
+    }
+
+    memset(machines, 0, count * sizeof(*machines));
+
+    for (unsigned i = 0; i < count; i++) {
+        zx_init(&machines[i].zx, &(zx_desc_t) {
+            .type = ZX_TYPE_48K,
+            .joystick_type = ZX_JOYSTICKTYPE_KEMPSTON,
+            .pixel_buffer = machines[i].pixel_buffer,
+            .pixel_buffer_size = sizeof(machines[i].pixel_buffer),
+            .ram = machines[i].ram,
+            .ram_size = sizeof(machines[i].ram),
+            .share_roms = true,
+            .rom_zx48k = rom,
+            .rom_zx48k_size = rom_len
+        });
+
+        if (data != NULL && !zx_quickload(&machines[i].zx, (uint8_t const*)data, size)) {
+            free(machines);
+            return NULL;
+        }
+
+        zx_set_input_state(&machines[i].zx, (uint64_t)1 << (i % 40), 0);
+    }
+
+    return machines;
+}
+
+static bool same_machine(machine_t const* const a, machine_t const* const b) {
+    z80_t const* const ca = &a->zx.cpu;
+    z80_t const* const cb = &b->zx.cpu;
+
+    return memcmp(a->ram, b->ram, sizeof(a->ram)) == 0
+        && memcmp(a->pixel_buffer, b->pixel_buffer, sizeof(a->pixel_buffer)) == 0
+        && ca->bc_de_hl_fa == cb->bc_de_hl_fa && ca->bc_de_hl_fa_ == cb->bc_de_hl_fa_
+        && ca->wz_ix_iy_sp == cb->wz_ix_iy_sp && ca->im_ir_pc_bits == cb->im_ir_pc_bits;
+}
+
+int main(int const argc, char const* const argv[]) {
+    unsigned long count = 256;
+    unsigned long frames = 50;
+    char const* path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = strtoul(argv[++i], NULL, 10);
+        }
+        else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-n machines] [-f frames] [file.z80]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (count == 0 || count > ZX_LOCKSTEP_MAX_SYSTEMS) {
+        fprintf(stderr, "The number of machines must be between 1 and %d\n", ZX_LOCKSTEP_MAX_SYSTEMS);
+        return EXIT_FAILURE;
+    }
+
+    void* data = NULL;
+    size_t size = 0;
+
+    if (path != NULL) {
+        data = bench_load(path, &size);
+
+        if (data == NULL) {
+            fprintf(stderr, "Error loading \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    machine_t* const scalar = create_machines(count, data, size);
+    machine_t* const lockstep = create_machines(count, data, size);
+
+    if (scalar == NULL || lockstep == NULL) {
+        fprintf(stderr, "Error creating %lu machines\n", count);
+        return EXIT_FAILURE;
+    }
+
+    /* Scalar core */
+    uint64_t t0 = bench_now();
+
+    for (unsigned long f = 0; f < frames; f++) {
+        for (unsigned long i = 0; i < count; i++) {
+            zx_exec(&scalar[i].zx, US_PER_FRAME);
+        }
+    }
+
+    double const scalar_seconds = (bench_now() - t0) / 1e9;
+
+    /* Lock-step engine */
+    static zx_lockstep_t ls;
+    static zx_t* systems[ZX_LOCKSTEP_MAX_SYSTEMS];
+
+    for (unsigned long i = 0; i < count; i++) {
+        systems[i] = &lockstep[i].zx;
+    }
+
+    zx_lockstep_init(&ls, systems, count);
+    t0 = bench_now();
+
+    for (unsigned long f = 0; f < frames; f++) {
+        zx_lockstep_exec(&ls, US_PER_FRAME);
+    }
+
+    double const lockstep_seconds = (bench_now() - t0) / 1e9;
+
+    bool match = true;
+
+    for (unsigned long i = 0; i < count; i++) {
+        match = match && same_machine(scalar + i, lockstep + i);
+    }
+
+    uint64_t const instructions = ls.vector_instructions + ls.scalar_instructions;
+
+    printf("{\n");
+    printf("  \"file\": ");
+    bench_print_string(path);
+    printf(",\n");
+    printf("  \"machines\": %lu,\n", count);
+    printf("  \"frames\": %lu,\n", frames);
+    printf("  \"scalar_fps\": %.2f,\n", count * frames / scalar_seconds);
+    printf("  \"lockstep_fps\": %.2f,\n", count * frames / lockstep_seconds);
+    printf("  \"vector_instructions\": %" PRIu64 ",\n", ls.vector_instructions);
+    printf("  \"scalar_instructions\": %" PRIu64 ",\n", ls.scalar_instructions);
+    printf("  \"vector_ratio\": %.4f,\n", instructions != 0 ? (double)ls.vector_instructions / instructions : 0.0);
+    printf("  \"match\": %s\n", match ? "true" : "false");
+    printf("}\n");
+
+    free(lockstep);
+    free(scalar);
+    free(data);
+
+    if (!match) {
+        fprintf(stderr, "The lock-step engine doesn't match the scalar core\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
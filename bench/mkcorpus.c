@@ -0,0 +1,340 @@
+/*
+Generates the synthetic benchmark workloads in bench/corpus. Each workload is a small Z80 program assembled here and
+wrapped into a version 3 .z80 snapshot for the 48K, using the same header structures zx_quickload parses.
+
+    zx48k_mkcorpus output_dir
+
+All programs run with interrupts in mode 2, with a vector table at 0xFE00 pointing to an EI/RET handler at 0xFDFD, so
+they don't depend on the ROM system variables. Code starts at 0x8000, the stack is at 0xFD00.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHIPS_IMPL
+#include "ay38910.h"
+#include "beeper.h"
+#include "clk.h"
+#include "kbd.h"
+#include "mem.h"
+#include "z80.h"
+#include "zx.h"
+
+#define CODE_ADDR 0x8000
+#define DATA_ADDR 0xa000
+#define VARS_ADDR 0xf000
+#define STACK_ADDR 0xfd00
+
+typedef struct {
+    /* 0x4000-0xffff */
+    uint8_t mem[0xc000];
+    uint16_t pc;
+}
+asm_t;
+
+static void poke(asm_t* const a, uint16_t const addr, uint8_t const value) {
+    a->mem[addr - 0x4000] = value;
+}
+
+static void emit(asm_t* const a, int const count, ...) {
+    va_list args;
+    va_start(args, count);
+
+    for (int i = 0; i < count; i++) {
+        poke(a, a->pc++, (uint8_t)va_arg(args, int));
+    }
+
+    va_end(args);
+}
+
+static void emit16(asm_t* const a, uint8_t const opcode, uint16_t const nn) {
+    emit(a, 3, opcode, nn & 0xff, nn >> 8);
+}
+
+static void emit_ed16(asm_t* const a, uint8_t const opcode, uint16_t const nn) {
+    emit(a, 4, 0xed, opcode, nn & 0xff, nn >> 8);
+}
+
+/* Relative jumps (JR, JR cc, DJNZ) to a label already emitted */
+static void emit_rel(asm_t* const a, uint8_t const opcode, uint16_t const target) {
+    int const offset = target - (a->pc + 2);
+
+    if (offset < -128 || offset > 127) {
+        fprintf(stderr, "Relative jump out of range at 0x%04x\n", a->pc);
+        exit(EXIT_FAILURE);
+    }
+
+    emit(a, 2, opcode, offset & 0xff);
+}
+
+#define LD_A_N(n)    emit(a, 2, 0x3e, (n))
+#define LD_B_N(n)    emit(a, 2, 0x06, (n))
+#define LD_C_N(n)    emit(a, 2, 0x0e, (n))
+#define LD_B_C()     emit(a, 1, 0x41)
+#define LD_D_A()     emit(a, 1, 0x57)
+#define LD_E_A()     emit(a, 1, 0x5f)
+#define LD_HL_NN(nn) emit16(a, 0x21, (nn))
+#define LD_DE_NN(nn) emit16(a, 0x11, (nn))
+#define LD_BC_NN(nn) emit16(a, 0x01, (nn))
+#define LD_SP_NN(nn) emit16(a, 0x31, (nn))
+#define LD_A_MEM(nn) emit16(a, 0x3a, (nn))
+#define LD_MEM_A(nn) emit16(a, 0x32, (nn))
+#define LD_MEM_SP(nn) emit_ed16(a, 0x73, (nn))
+#define LD_SP_MEM(nn) emit_ed16(a, 0x7b, (nn))
+#define LD_I_A()     emit(a, 2, 0xed, 0x47)
+#define IM_2()       emit(a, 2, 0xed, 0x5e)
+#define LDIR()       emit(a, 2, 0xed, 0xb0)
+#define IN_A_C()     emit(a, 2, 0xed, 0x78)
+#define OUT_N_A(n)   emit(a, 2, 0xd3, (n))
+#define INC_A()      emit(a, 1, 0x3c)
+#define INC_C()      emit(a, 1, 0x0c)
+#define XOR_N(n)     emit(a, 2, 0xee, (n))
+#define RLCA()       emit(a, 1, 0x07)
+#define RLC_B()      emit(a, 2, 0xcb, 0x00)
+#define PUSH_DE()    emit(a, 1, 0xd5)
+#define DI()         emit(a, 1, 0xf3)
+#define EI()         emit(a, 1, 0xfb)
+#define HALT()       emit(a, 1, 0x76)
+#define JR(l)        emit_rel(a, 0x18, (l))
+#define JR_C(l)      emit_rel(a, 0x38, (l))
+#define DJNZ(l)      emit_rel(a, 0x10, (l))
+
+/* Common setup: IM 2 vector table and handler, stack, then the workload code */
+static void asm_init(asm_t* const a) {
+    memset(a, 0, sizeof(*a));
+
+    for (int i = 0; i < 257; i++) {
+        poke(a, 0xfe00 + i, 0xfd);
+    }
+
+    poke(a, 0xfdfd, 0xfb); /* EI */
+    poke(a, 0xfdfe, 0xc9); /* RET */
+
+    a->pc = CODE_ADDR;
+    DI();
+    LD_SP_NN(STACK_ADDR);
+    LD_A_N(0xfe);
+    LD_I_A();
+    IM_2();
+    EI();
+}
+
+/* Deterministic pseudo-random bytes for screen and data fills */
+static uint8_t asm_random(uint32_t* const seed) {
+    *seed = *seed * 1103515245U + 12345U;
+    return *seed >> 16;
+}
+
+/* LDIR-heavy memory copies: a 6912 byte picture copied to the screen and back to high memory */
+static void gen_ldir(asm_t* const a) {
+    asm_init(a);
+
+    uint32_t seed = 1;
+
+    for (int i = 0; i < 0x1b00; i++) {
+        poke(a, DATA_ADDR + i, asm_random(&seed));
+    }
+
+    uint16_t const loop = a->pc;
+    LD_HL_NN(DATA_ADDR);
+    LD_DE_NN(0x4000);
+    LD_BC_NN(0x1b00);
+    LDIR();
+    LD_HL_NN(0x4000);
+    LD_DE_NN(0xc000);
+    LD_BC_NN(0x1b00);
+    LDIR();
+    LD_A_MEM(DATA_ADDR);
+    INC_A();
+    LD_MEM_A(DATA_ADDR);
+    JR(loop);
+}
+
+/* Beeper music: dense OUTs to port 0xFE sweeping the tone period, also toggling the border */
+static void gen_beeper(asm_t* const a) {
+    asm_init(a);
+    LD_A_N(0x00);
+    LD_C_N(0x01);
+    uint16_t const loop = a->pc;
+    LD_B_C();
+    uint16_t const wait = a->pc;
+    DJNZ(wait);
+    XOR_N(0x11);
+    OUT_N_A(0xfe);
+    INC_C();
+    JR(loop);
+}
+
+/* Full-screen redraw every frame, filling the whole display file with PUSH after each interrupt */
+static void gen_redraw(asm_t* const a) {
+    asm_init(a);
+    uint16_t const loop = a->pc;
+    EI();
+    HALT();
+    DI();
+    LD_MEM_SP(VARS_ADDR);
+    LD_A_MEM(VARS_ADDR + 2);
+    INC_A();
+    LD_MEM_A(VARS_ADDR + 2);
+    LD_E_A();
+    RLCA();
+    LD_D_A();
+    LD_SP_NN(0x5b00);
+    LD_B_N(0x1b00 / 32);
+    uint16_t const fill = a->pc;
+
+    for (int i = 0; i < 16; i++) {
+        PUSH_DE();
+    }
+
+    DJNZ(fill);
+    LD_SP_MEM(VARS_ADDR);
+    JR(loop);
+}
+
+/* Keyboard polling loop: scans all eight half-rows through port 0xFE continuously */
+static void gen_kbdpoll(asm_t* const a) {
+    asm_init(a);
+    uint16_t const loop = a->pc;
+    LD_BC_NN(0xfefe);
+    uint16_t const row = a->pc;
+    IN_A_C();
+    RLC_B();
+    JR_C(row);
+    LD_A_MEM(0x5800);
+    INC_A();
+    LD_MEM_A(0x5800);
+    JR(loop);
+}
+
+/* HALT-idle game: a static screen and a single attribute update per frame */
+static void gen_halt(asm_t* const a) {
+    asm_init(a);
+
+    uint32_t seed = 2;
+
+    for (int i = 0; i < 0x1b00; i++) {
+        poke(a, 0x4000 + i, asm_random(&seed));
+    }
+
+    uint16_t const loop = a->pc;
+    HALT();
+    LD_A_MEM(0x5800);
+    INC_A();
+    LD_MEM_A(0x5800);
+    JR(loop);
+}
+
+/* Compresses a 16K page using the .z80 ED ED run-length scheme */
+static size_t compress(uint8_t const* const src, uint8_t* const dst) {
+    size_t in = 0, out = 0;
+
+    while (in < 0x4000) {
+        uint8_t const value = src[in];
+        size_t run = 1;
+
+        while (in + run < 0x4000 && src[in + run] == value && run < 255) {
+            run++;
+        }
+
+        if (run >= 5 || (value == 0xed && run >= 2)) {
+            dst[out++] = 0xed;
+            dst[out++] = 0xed;
+            dst[out++] = run;
+            dst[out++] = value;
+            in += run;
+        }
+        else if (value == 0xed) {
+            /* A single ED must be followed by a byte that's not taken into a block */
+            dst[out++] = 0xed;
+            in++;
+
+            if (in < 0x4000) {
+                dst[out++] = src[in++];
+            }
+        }
+        else {
+            dst[out++] = value;
+            in++;
+        }
+    }
+
+    return out;
+}
+
+static int write_z80(char const* const path, asm_t const* const a) {
+    _zx_z80_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.A = 0xff;
+    hdr.F = 0xff;
+    hdr.SP_l = STACK_ADDR & 0xff;
+    hdr.SP_h = STACK_ADDR >> 8;
+    hdr.flags0 = 7 << 1; /* white border */
+    hdr.flags1 = 1;      /* IM 1 until the code sets up IM 2 */
+
+    _zx_z80_ext_header ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.len_l = 54;
+    ext.PC_l = CODE_ADDR & 0xff;
+    ext.PC_h = CODE_ADDR >> 8;
+    ext.hw_mode = 0;     /* 48K */
+
+    FILE* const file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    fwrite(&hdr, 1, sizeof(hdr), file);
+    fwrite(&ext, 1, 2 + 54, file);
+
+    /* Pages 8, 4 and 5 hold 0x4000, 0x8000 and 0xc000 on the 48K */
+    static uint8_t const page_nrs[3] = {8, 4, 5};
+
+    for (int i = 0; i < 3; i++) {
+        static uint8_t data[0x4000 * 2];
+        size_t const size = compress(a->mem + i * 0x4000, data);
+
+        _zx_z80_page_header phdr;
+        phdr.len_l = size & 0xff;
+        phdr.len_h = size >> 8;
+        phdr.page_nr = page_nrs[i];
+
+        fwrite(&phdr, 1, sizeof(phdr), file);
+        fwrite(data, 1, size, file);
+    }
+
+    return fclose(file) == 0;
+}
+
+int main(int const argc, char const* const argv[]) {
+    static struct {char const* name; void (*generate)(asm_t*);} const workloads[] = {
+        {"ldir", gen_ldir},
+        {"beeper", gen_beeper},
+        {"redraw", gen_redraw},
+        {"kbdpoll", gen_kbdpoll},
+        {"halt", gen_halt}
+    };
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s output_dir\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        static asm_t a;
+        workloads[i].generate(&a);
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.z80", argv[1], workloads[i].name);
+
+        if (!write_z80(path, &a)) {
+            fprintf(stderr, "Error writing \"%s\"\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
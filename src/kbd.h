@@ -38,7 +38,7 @@
     of the 'sticky count' and auto-release sticky key presses which
     have expired.
 
-    There's two ways to chech the state of the keyboard matrix:
+    There's three ways to chech the state of the keyboard matrix:
 
     (1) Call the functions kbd_test_lines() or kbd_test_columns(), these
     take a bit mask of active columns or lines as input, and return a bit mask
@@ -51,6 +51,18 @@
     kbd_scan_lines() or kbd_scan_columns() to get the resulting scanned
     bit mask.
 
+    (3) For the common case of an 8-column matrix scanned with an 8-bit
+    column mask (e.g. the upper byte of a port address), call the inline
+    function kbd_lookup_lines(), this is a single lookup into a 256-entry
+    table which is rebuilt whenever the pressed-key state changes.
+
+    If the host system already has the complete state of the keyboard matrix
+    at hand (for instance one bit per matrix cross-section, polled once per
+    frame), call kbd_set_matrix() instead of feeding individual key presses,
+    this replaces the 'raw' matrix state in one go and only updates the
+    internal scanout state once. Raw matrix bits are not sticky, and they are
+    combined with the keys in the pressed-key buffer.
+
     All functions for testing/scanning the keyboard matrix state are 'fast'
     because of internal state caching, most processing happens in the
     less frequently called functions kbd_update(), kbd_key_down() and
@@ -119,6 +131,10 @@ typedef struct {
     /* active column/line masks, updated when key pressed state changes */
     uint16_t scanout_column_masks[KBD_MAX_LINES];
     uint16_t scanout_line_masks[KBD_MAX_COLUMNS];
+    /* raw lit lines per column set with kbd_set_matrix() */
+    uint16_t matrix_line_masks[KBD_MAX_COLUMNS];
+    /* lit lines for every possible 8-bit column mask (columns 0..7) */
+    uint16_t scanout_line_lut[256];
     /* last cached column / scanout combinations */
     uint16_t cur_column_mask;
     uint16_t cur_scanout_line_mask;
@@ -142,6 +158,8 @@ void kbd_register_key(kbd_t* kbd, int key, int column, int line, int mod_mask);
 void kbd_key_down(kbd_t* kbd, int key);
 /* remove a key from the pressed-key buffer */
 void kbd_key_up(kbd_t* kbd, int key);
+/* replace the raw keyboard matrix state with the lit lines of each column */
+void kbd_set_matrix(kbd_t* kbd, const uint16_t* line_masks, int num_columns);
 /* test keyboard matrix against a column bitmask and return lit lines */
 uint16_t kbd_test_lines(kbd_t* kbd, uint16_t column_mask);
 /* test keyboard matrix against a line bitmask and return lit columns */
@@ -154,6 +172,10 @@ uint16_t kbd_scan_lines(kbd_t* kbd);
 void kbd_set_active_lines(kbd_t* kbd, uint16_t line_mask);
 /* scan active columns (used together with kbd_set_active_lines */
 uint16_t kbd_scan_columns(kbd_t* kbd);
+/* test the first 8 keyboard matrix columns against an 8-bit column mask and return lit lines */
+static inline uint16_t kbd_lookup_lines(const kbd_t* kbd, uint8_t column_mask) {
+    return kbd->scanout_line_lut[column_mask];
+}
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -302,6 +324,25 @@ static void _kbd_update_scanout_masks(kbd_t* kbd) {
     }
     for (int col = 0; col < KBD_MAX_COLUMNS; col++) {
         kbd->scanout_line_masks[col] = _kbd_test_lines(kbd, (1<<col));
+        /* merge the raw matrix state */
+        const uint16_t lines = kbd->matrix_line_masks[col];
+        kbd->scanout_line_masks[col] |= lines;
+        for (int line = 0; line < KBD_MAX_LINES; line++) {
+            if (lines & (1<<line)) {
+                kbd->scanout_column_masks[line] |= (1<<col);
+            }
+        }
+    }
+    /* each 8-bit column mask combines the mask without its lowest bit
+       with the lines of the column of its lowest bit
+    */
+    kbd->scanout_line_lut[0] = 0;
+    for (int mask = 1; mask < 256; mask++) {
+        int col = 0;
+        while (0 == (mask & (1<<col))) {
+            col++;
+        }
+        kbd->scanout_line_lut[mask] = kbd->scanout_line_lut[mask & (mask-1)] | kbd->scanout_line_masks[col];
     }
     kbd->cur_column_mask = 0;
     kbd->cur_scanout_line_mask = 0;
@@ -313,6 +354,7 @@ void kbd_update(kbd_t* kbd, uint32_t frame_time_us) {
     CHIPS_ASSERT(kbd);
     kbd->cur_time += frame_time_us;
     /* check for sticky keys that should be released */
+    bool changed = false;
     for (int i = 0; i < KBD_MAX_PRESSED_KEYS; i++) {
         key_state_t* k = &kbd->key_buffer[i];
         if (k->released) {
@@ -323,10 +365,13 @@ void kbd_update(kbd_t* kbd, uint32_t frame_time_us) {
                 k->key = 0;
                 k->pressed_time = 0;
                 k->released = false;
+                changed = true;
             }
         }
     }
-    _kbd_update_scanout_masks(kbd);
+    if (changed) {
+        _kbd_update_scanout_masks(kbd);
+    }
 }
 
 void kbd_key_down(kbd_t* kbd, int key) {
@@ -338,8 +383,8 @@ void kbd_key_down(kbd_t* kbd, int key) {
     for (int i = 0; i < KBD_MAX_PRESSED_KEYS; i++) {
         key_state_t* k = &kbd->key_buffer[i];
         if (k->key == key) {
+            /* the key is already in the matrix, no need to update the scanout masks */
             k->pressed_time = kbd->cur_time;
-            _kbd_update_scanout_masks(kbd);
             return;
         }
     }
@@ -358,18 +403,38 @@ void kbd_key_down(kbd_t* kbd, int key) {
 
 void kbd_key_up(kbd_t* kbd, int key) {
     CHIPS_ASSERT(kbd && (key >= 0) && (key < KBD_MAX_KEYS));
-    /* find the key in the keybuffer, just set released_frame */
+    /* find the key in the keybuffer, just set released_frame,
+       the key stays in the matrix until kbd_update() expires it,
+       so the scanout masks don't change here
+    */
     for (int i = 0; i < KBD_MAX_PRESSED_KEYS; i++) {
         key_state_t* k = &kbd->key_buffer[i];
         if (key == k->key) {
             k->released = true;
         }
     }
-    _kbd_update_scanout_masks(kbd);
+}
+
+void kbd_set_matrix(kbd_t* kbd, const uint16_t* line_masks, int num_columns) {
+    CHIPS_ASSERT(kbd && line_masks && (num_columns >= 0) && (num_columns <= KBD_MAX_COLUMNS));
+    bool changed = false;
+    for (int col = 0; col < KBD_MAX_COLUMNS; col++) {
+        const uint16_t lines = (col < num_columns) ? (line_masks[col] & ((1<<KBD_MAX_LINES)-1)) : 0;
+        if (lines != kbd->matrix_line_masks[col]) {
+            kbd->matrix_line_masks[col] = lines;
+            changed = true;
+        }
+    }
+    if (changed) {
+        _kbd_update_scanout_masks(kbd);
+    }
 }
 
 /* scan keyboard matrix lines by column mask */
 uint16_t kbd_test_lines(kbd_t* kbd, uint16_t column_mask) {
+    if (column_mask < 256) {
+        return kbd->scanout_line_lut[column_mask];
+    }
     if (column_mask != kbd->cur_column_mask) {
         kbd->cur_column_mask = column_mask;
         kbd->cur_scanout_line_mask = 0;
@@ -1,10 +1,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "libretro.h"
 #include "hcdebug.h"
 #include "rom.h"
+#include "boot.h"
+#include "zx48k.h"
+
+#ifdef ZX48K_STATS
+#include <time.h>
+
+static uint64_t zx48k_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+/* Have the emulator count events and time the video decoding */
+#define ZX_STATS
+#define ZX_STATS_NOW() zx48k_now()
+
+#define ZX48K_STATS_BEGIN(name) uint64_t const name ## _t0 = zx48k_now()
+#define ZX48K_STATS_END(name, field) self->stats.frame.field += zx48k_now() - name ## _t0
+#else
+#define ZX48K_STATS_BEGIN(name)
+#define ZX48K_STATS_END(name, field)
+#endif
+
+#ifdef ZX48K_TRACE
+#include "zx48k_trace.h"
+
+/* Have the emulator trace the video decoding */
+#define ZX_TRACE_BEGIN(name) zx48k_trace_begin(name)
+#define ZX_TRACE_END() zx48k_trace_end()
+
+#define ZX48K_TRACE_BEGIN(name) zx48k_trace_begin(name)
+#define ZX48K_TRACE_END() zx48k_trace_end()
+#else
+#define ZX48K_TRACE_BEGIN(name)
+#define ZX48K_TRACE_END()
+#endif
 
 #define CHIPS_IMPL
 #include "ay38910.h"
@@ -18,29 +55,121 @@
 #define ZX48K_FRAMES_PER_SECOND 50U
 #define ZX48K_US_PER_FRAME (1000000U / ZX48K_FRAMES_PER_SECOND)
 
+/* What to leave out while the frontend fast-forwards, and how many frames are emulated per frame shown */
+#define ZX48K_FAST_FORWARD_SKIP_FRAMES 0
+#define ZX48K_FAST_FORWARD_SKIP_AUDIO 1
+#define ZX48K_FAST_FORWARD_FULL 2
+#define ZX48K_FAST_FORWARD_FRAMESKIP 4
+
+/* A frame of up to the full border, in the pixel format given to the frontend, headless machines use pixels32 in the
+emulator's format */
+typedef union {
+    uint32_t pixels32[ZX_MAX_DISPLAY_WIDTH * ZX_MAX_DISPLAY_HEIGHT];
+    uint16_t pixels16[ZX_MAX_DISPLAY_WIDTH * ZX_MAX_DISPLAY_HEIGHT];
+}
+zx48k_frame_t;
+
+/* The last frame presented or returned by zx48k_get_pixels, and the scanlines it shows */
 typedef struct {
+    zx48k_frame_t frame;
+    zx_scanline_t expanded[ZX_MAX_DISPLAY_HEIGHT];
+}
+zx48k_output_t;
+
+/* Expands the scanlines of a finished frame into pixels on a worker thread, while the next frame is emulated */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    bool busy;
+    bool quit;
+
+    /* The frame being expanded into frames[current], frames[current ^ 1] has the previous one */
+    zx_scanline_t scanlines[ZX_MAX_DISPLAY_HEIGHT];
+    unsigned num_lines;
+    zx48k_frame_t frames[2];
+    zx_scanline_t expanded[2][ZX_MAX_DISPLAY_HEIGHT];
+    unsigned current;
+    unsigned num_frames;
+}
+zx48k_renderer_t;
+
+static void zx48k_renderer_destroy(zx48k_renderer_t* const self);
+
+/* Frontend callbacks, shared by the process since libretro has no per-instance state */
+typedef struct {
+    retro_log_printf_t log_cb;
+    retro_environment_t env_cb;
+    retro_video_refresh_t video_cb;
+    retro_audio_sample_batch_t audio_cb;
+    retro_input_poll_t input_poll_cb;
+    retro_input_state_t input_state_cb;
+    bool has_keyboard_cb;
+    bool can_dupe;
+
+    /* Chosen at retro_load_game, RGB565 if set, XRGB8888 otherwise */
+    bool rgb565;
+    unsigned pixel_size;
+}
+zx48k_frontend_t;
+
+struct zx48k_t {
     /* The emulator */
     zx_t zx;
     uint64_t key_states;
-    uint32_t pixel_buffer[320 * 256];
+    uint8_t joy_mask;
+    bool late_input;
+    uint8_t fast_forward;
+    unsigned skipped_frames;
+    bool render_thread;
+    bool no_contention;
+    zx48k_border_t border;
+    bool skip_video;
+    uint64_t audio_hash;
+    uint8_t ram[3][0x4000];
+    zx_scanline_t scanlines[ZX_MAX_DISPLAY_HEIGHT];
+
+    /* Allocated when first needed, headless machines that only observe the display RAM never have one */
+    zx48k_output_t* output;
     unsigned width;
     unsigned height;
 
-    /* Z80 snapshot contets for retro_reset */
+    /* Z80 snapshot contets for zx48k_reset */
     void const* data;
     size_t size;
 
-    /* Frontend callbacks */
+    /* The frontend this machine presents to and reads input from, NULL for headless machines */
+    zx48k_frontend_t const* frontend;
     retro_log_printf_t log_cb;
-    retro_environment_t env_cb;
-    retro_video_refresh_t video_cb;
-    retro_audio_sample_batch_t audio_cb;
-    retro_input_poll_t input_poll_cb;
-    retro_input_state_t input_state_cb;
-}
-zx48k_t;
 
-static zx48k_t zx48k;
+    /* The worker thread, only created when render_thread is set */
+    zx48k_renderer_t* renderer;
+
+#ifdef ZX48K_STATS
+    zx48k_stats_t stats;
+#endif
+};
+
+static zx48k_frontend_t zx48k_frontend;
+
+/* The emulator's palette in the XRGB8888 format the frontend wants */
+static uint32_t zx48k_xrgb_palette[16];
+
+/* The machine driven by the libretro API */
+static zx48k_t* zx48k;
+
+/* Keyboard matrix, one bit per key in key_states starting at column 0, row 0 */
+static unsigned const zx48k_kbd_map[8][5] = {
+    {RETROK_LSHIFT, RETROK_z,     RETROK_x, RETROK_c, RETROK_v},
+    {RETROK_a,      RETROK_s,     RETROK_d, RETROK_f, RETROK_g},
+    {RETROK_q,      RETROK_w,     RETROK_e, RETROK_r, RETROK_t},
+    {RETROK_1,      RETROK_2,     RETROK_3, RETROK_4, RETROK_5},
+    {RETROK_0,      RETROK_9,     RETROK_8, RETROK_7, RETROK_6},
+    {RETROK_p,      RETROK_o,     RETROK_i, RETROK_u, RETROK_y},
+    {RETROK_RETURN, RETROK_l,     RETROK_k, RETROK_j, RETROK_h},
+    {RETROK_SPACE,  RETROK_LCTRL, RETROK_m, RETROK_n, RETROK_b}
+};
 
 static void dummy_log(enum retro_log_level const level, char const* const fmt, ...) {
     (void)level;
@@ -48,9 +177,11 @@ static void dummy_log(enum retro_log_level const level, char const* const fmt, .
 }
 
 static void zx48k_audio_cb(float const* const samples, int const num_samples, void* const ud) {
-    static int16_t pcm16[ZX_MAX_AUDIO_SAMPLES * 2];
+    zx48k_t* const self = (zx48k_t*)ud;
+    int16_t pcm16[ZX_MAX_AUDIO_SAMPLES * 2];
 
-    (void)ud;
+    ZX48K_TRACE_BEGIN("audio_cb");
+    ZX48K_STATS_BEGIN(audio);
 
     for (int i = 0, j = 0; i < num_samples; i++, j += 2) {
         float sample = samples[i];
@@ -66,51 +197,171 @@ static void zx48k_audio_cb(float const* const samples, int const num_samples, vo
         pcm16[j + 1] = sample * 32767;
     }
 
-    zx48k.audio_cb(pcm16, num_samples);
+    self->frontend->audio_cb(pcm16, num_samples);
+    self->audio_hash = zx_hash(self->audio_hash, samples, num_samples * sizeof(*samples));
+
+    ZX48K_STATS_END(audio, audio_ns);
+    ZX48K_TRACE_END();
+}
+
+static void zx48k_read_variables(zx48k_t* const self) {
+    struct retro_variable var = {"zx48k_input_poll", NULL};
+
+    if (self->frontend->env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL) {
+        self->late_input = !strcmp(var.value, "late");
+    }
+
+    var.key = "zx48k_fast_forward";
+    var.value = NULL;
+
+    if (self->frontend->env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL) {
+        if (!strcmp(var.value, "skip audio")) {
+            self->fast_forward = ZX48K_FAST_FORWARD_SKIP_AUDIO;
+        }
+        else if (!strcmp(var.value, "full")) {
+            self->fast_forward = ZX48K_FAST_FORWARD_FULL;
+        }
+        else {
+            self->fast_forward = ZX48K_FAST_FORWARD_SKIP_FRAMES;
+        }
+    }
+
+    var.key = "zx48k_render_thread";
+    var.value = NULL;
+
+    if (self->frontend->env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL) {
+        self->render_thread = !strcmp(var.value, "on");
+    }
+
+    var.key = "zx48k_contention";
+    var.value = NULL;
+
+    if (self->frontend->env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL) {
+        self->no_contention = !strcmp(var.value, "off");
+    }
+
+    var.key = "zx48k_border";
+    var.value = NULL;
+
+    if (self->frontend->env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL) {
+        if (!strcmp(var.value, "none")) {
+            self->border = ZX48K_BORDER_NONE;
+        }
+        else if (!strcmp(var.value, "full")) {
+            self->border = ZX48K_BORDER_FULL;
+        }
+        else {
+            self->border = ZX48K_BORDER_SMALL;
+        }
+    }
 }
 
-static void zx48k_reset(void) {
-    zx_init(&zx48k.zx, &(zx_desc_t) {
+static void zx48k_keyboard_cb(bool const down, unsigned const keycode, uint32_t const character, uint16_t const key_modifiers) {
+    (void)character;
+    (void)key_modifiers;
+
+    if (zx48k == NULL) {
+        return;
+    }
+
+    uint64_t key = 1;
+
+    for (int col = 0; col < 8; col++) {
+        for (int row = 0; row < 5; row++, key <<= 1) {
+            if (zx48k_kbd_map[col][row] == keycode) {
+                if (down) {
+                    zx48k->key_states |= key;
+                }
+                else {
+                    zx48k->key_states &= ~key;
+                }
+
+                return;
+            }
+        }
+    }
+}
+
+static void zx48k_input_cb(void* const ud);
+
+static void zx48k_init(zx48k_t* const self) {
+    zx_init(&self->zx, &(zx_desc_t) {
         .type = ZX_TYPE_48K,
         .joystick_type = ZX_JOYSTICKTYPE_KEMPSTON,
-        .pixel_buffer = zx48k.pixel_buffer,
-        .pixel_buffer_size = sizeof(zx48k.pixel_buffer),
-        .user_data = NULL,
-        .audio_cb = zx48k_audio_cb,
+        .disable_contention = self->no_contention,
+        .border = (zx_border_t)self->border,
+        /* Record the scanlines so the pixels can be made later, and in the frontend's format */
+        .scanlines = self->scanlines,
+        .user_data = self,
+        /* Headless machines don't need the audio samples */
+        .audio_cb = self->frontend != NULL ? zx48k_audio_cb : NULL,
         .audio_num_samples = ZX_DEFAULT_AUDIO_SAMPLES,
         .audio_sample_rate = 44100,
+        .input_cb = zx48k_input_cb,
+        .ram = self->ram,
+        .ram_size = sizeof(self->ram),
+        /* All machines in the process map the same read-only ROM */
+        .share_roms = true,
         .rom_zx48k = rom,
         .rom_zx48k_size = rom_len
     });
 
     /* Keep these around for the video callback */
-    zx48k.width = zx_display_width(&zx48k.zx);
-    zx48k.height = zx_display_height(&zx48k.zx);
+    self->width = zx_display_width(&self->zx);
+    self->height = zx_display_height(&self->zx);
 
-    /* Reset the keyboard and register our own keys */
-    zx48k.key_states = 0;
-    kbd_init(&zx48k.zx.kbd, 1);
+    /* Expand every scanline of the next frame */
+    if (self->output != NULL) {
+        memset(self->output->expanded, 0xff, sizeof(self->output->expanded));
+    }
 
-    int code = 128;
+    /* Reset the keyboard */
+    self->key_states = 0;
+}
 
-    for (int col = 0; col < 8; col++) {
-        for (int row = 0; row < 5; row++, code++) {
-            kbd_register_key(&zx48k.zx.kbd, code, col, row, 0);
-        }
+/* Restores the state the ROM is in after its RAM test and initialisation, generated by src/mkboot.c */
+static void zx48k_boot(zx48k_t* const self) {
+    if (!zx_quickload(&self->zx, boot, boot_len)) {
+        self->log_cb(RETRO_LOG_ERROR, "Error restoring the booted ROM state\n");
+    }
+}
+
+zx48k_t* zx48k_create(void) {
+    /* zx_t is aligned to a cache line, which calloc doesn't guarantee */
+    zx48k_t* const self = (zx48k_t*)aligned_alloc(_Alignof(zx48k_t), sizeof(*self));
+
+    if (self != NULL) {
+        memset(self, 0, sizeof(*self));
+        self->log_cb = dummy_log;
+        zx48k_init(self);
+        zx48k_boot(self);
+    }
+
+    return self;
+}
+
+void zx48k_destroy(zx48k_t* const self) {
+    if (self != NULL) {
+        zx48k_renderer_destroy(self->renderer);
+        free(self->output);
+        free((void*)self->data);
+        free(self);
     }
 }
 
-static bool zx48k_load(void const* const data, size_t const size) {
-    if (zx48k.data != NULL) {
-        free((void*)zx48k.data);
-        zx48k.data = NULL;
-        zx48k.size = 0;
+bool zx48k_load(zx48k_t* const self, void const* const data, size_t const size) {
+    if (self->data != NULL) {
+        free((void*)self->data);
+        self->data = NULL;
+        self->size = 0;
     }
 
     bool ok = true;
 
+    zx48k_init(self);
+
     if (data != NULL) {
-        if (!zx_quickload(&zx48k.zx, data, size)) {
+        if (!zx_quickload(&self->zx, data, size)) {
             return false;
         }
 
@@ -118,43 +369,215 @@ static bool zx48k_load(void const* const data, size_t const size) {
         void* copy = malloc(size);
 
         if (copy == NULL) {
-            zx48k.log_cb(RETRO_LOG_ERROR, "Error allocating memory for content, retro_reset won't reload the content");
+            self->log_cb(RETRO_LOG_ERROR, "Error allocating memory for content, zx48k_reset won't reload the content");
             return false;
         }
 
         memcpy(copy, data, size);
-        zx48k.data = copy;
-        zx48k.size = size;
+        self->data = copy;
+        self->size = size;
     }
     else {
-        zx48k_reset();
+        zx48k_boot(self);
     }
 
     return ok;
 }
 
+void zx48k_reset(zx48k_t* const self) {
+    zx48k_init(self);
+
+    if (self->data == NULL) {
+        zx48k_boot(self);
+    }
+    else if (!zx_quickload(&self->zx, self->data, self->size)) {
+        self->log_cb(RETRO_LOG_ERROR, "Error reloading content in zx48k_reset");
+    }
+}
+
+void zx48k_set_input(zx48k_t* const self, uint64_t const key_states, uint8_t const joy_mask) {
+    self->key_states = key_states;
+    self->joy_mask = joy_mask;
+}
+
+/* zx48k_border_t has the values of zx_border_t */
+void zx48k_set_border(zx48k_t* const self, zx48k_border_t const border) {
+    self->border = border;
+
+    if ((zx_border_t)border != self->zx.border) {
+        zx_set_border(&self->zx, (zx_border_t)border);
+        self->width = zx_display_width(&self->zx);
+        self->height = zx_display_height(&self->zx);
+    }
+}
+
+/* Returns the frame the scanlines are expanded into, allocating it on first use, NULL when out of memory */
+static zx48k_output_t* zx48k_get_output(zx48k_t* const self) {
+    if (self->output == NULL) {
+        self->output = (zx48k_output_t*)malloc(sizeof(*self->output));
+
+        if (self->output != NULL) {
+            memset(self->output->expanded, 0xff, sizeof(self->output->expanded));
+        }
+    }
+
+    return self->output;
+}
+
+uint32_t const* zx48k_get_pixels(zx48k_t* const self, unsigned* const width, unsigned* const height) {
+    zx48k_output_t* const output = zx48k_get_output(self);
+
+    if (output == NULL) {
+        return NULL;
+    }
+
+    zx_expand_changed_scanlines(self->scanlines, self->height, output->expanded, output->frame.pixels32, NULL);
+
+    *width = self->width;
+    *height = self->height;
+    return output->frame.pixels32;
+}
+
+void zx48k_get_hashes(zx48k_t* const self, zx48k_hashes_t* const hashes) {
+    hashes->frame = zx_frame_hash(&self->zx);
+    hashes->audio = self->audio_hash;
+    hashes->state = zx_state_hash(&self->zx);
+}
+
+size_t zx48k_observation_size(zx48k_t const* const self, zx48k_observation_t const observation) {
+    switch (observation) {
+        case ZX48K_OBSERVATION_DISPLAY: return 6144 + 768;
+        case ZX48K_OBSERVATION_INK_PLANE: return 6144;
+        case ZX48K_OBSERVATION_ATTRS: return 768;
+        default: return (size_t)self->width * self->height * 4;
+    }
+}
+
+bool zx48k_get_observation(zx48k_t* const self, zx48k_observation_t const observation, void* const dst) {
+    switch (observation) {
+        case ZX48K_OBSERVATION_DISPLAY:
+            zx_copy_display(&self->zx, (uint8_t*)dst);
+            break;
+
+        case ZX48K_OBSERVATION_INK_PLANE:
+            zx_copy_ink_plane(&self->zx, (uint8_t*)dst);
+            break;
+
+        case ZX48K_OBSERVATION_ATTRS:
+            zx_copy_attrs(&self->zx, (uint8_t*)dst);
+            break;
+
+        default: {
+            unsigned width, height;
+            uint32_t const* const pixels = zx48k_get_pixels(self, &width, &height);
+
+            if (pixels == NULL) {
+                return false;
+            }
+
+            memcpy(dst, pixels, (size_t)width * height * 4);
+            break;
+        }
+    }
+
+    return true;
+}
+
 static void* hc_set_debuggger(hc_DebuggerIf* const debugger_if);
 
+#ifdef ZX48K_STATS
+static void zx48k_stats_begin_frame(zx48k_t* const self) {
+    memset(&self->stats.frame, 0, sizeof(self->stats.frame));
+    memset(&self->zx.stats, 0, sizeof(self->zx.stats));
+}
+
+static void zx48k_stats_end_frame(zx48k_t* const self) {
+    zx48k_counters_t* const frame = &self->stats.frame;
+    zx_stats_t const* const zx = &self->zx.stats;
+
+    frame->frames = 1;
+    frame->ticks = zx->ticks;
+    frame->instructions = zx->instructions;
+    frame->mem_reads = zx->mem_reads;
+    frame->mem_writes = zx->mem_writes;
+    frame->io_cycles = zx->io_cycles;
+    frame->wait_states = zx->wait_states;
+    frame->tick_callbacks = zx->tick_callbacks;
+    frame->audio_callbacks = zx->audio_callbacks;
+    frame->scanlines = zx->scanlines;
+
+    /* Scanline decoding and audio output happen inside zx_exec */
+    frame->cpu_ns -= zx->video_ns + frame->audio_ns;
+    frame->video_ns += zx->video_ns;
+
+    zx48k_counters_t* const total = &self->stats.total;
+
+    total->frames += frame->frames;
+    total->ticks += frame->ticks;
+    total->instructions += frame->instructions;
+    total->mem_reads += frame->mem_reads;
+    total->mem_writes += frame->mem_writes;
+    total->io_cycles += frame->io_cycles;
+    total->wait_states += frame->wait_states;
+    total->tick_callbacks += frame->tick_callbacks;
+    total->audio_callbacks += frame->audio_callbacks;
+    total->scanlines += frame->scanlines;
+    total->cpu_ns += frame->cpu_ns;
+    total->video_ns += frame->video_ns;
+    total->audio_ns += frame->audio_ns;
+}
+#endif
+
+static zx48k_stats_t const* zx48k_get_stats(void) {
+#ifdef ZX48K_STATS
+    return zx48k != NULL ? &zx48k->stats : NULL;
+#else
+    return NULL;
+#endif
+}
+
+static void zx48k_get_frontend_hashes(zx48k_hashes_t* const hashes) {
+    zx48k_get_hashes(zx48k, hashes);
+}
+
 static retro_proc_address_t zx48k_get_proc(char const* const symbol) {
     if (!strcmp(symbol, "hc_set_debugger")) {
         return (retro_proc_address_t)hc_set_debuggger;
     }
+    else if (!strcmp(symbol, "zx48k_get_stats")) {
+        return (retro_proc_address_t)zx48k_get_stats;
+    }
+    else if (!strcmp(symbol, "zx48k_get_hashes")) {
+        return (retro_proc_address_t)zx48k_get_frontend_hashes;
+    }
 
     return NULL;
 }
 
 void retro_set_environment(retro_environment_t const cb) {
-    zx48k.env_cb = cb;
+    zx48k_frontend.env_cb = cb;
 
     bool yes = true;
     cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &yes);
 
+    static struct retro_variable const variables[] = {
+        {"zx48k_input_poll", "Input polling; early|late"},
+        {"zx48k_fast_forward", "Output while fast-forwarding; skip frames|skip audio|full"},
+        {"zx48k_render_thread", "Render on a worker thread, one frame late; off|on"},
+        {"zx48k_contention", "Contended memory timing; on|off"},
+        {"zx48k_pixel_format", "Pixel format, when content is loaded; xrgb8888|rgb565"},
+        {"zx48k_border", "Border; small|none|full"},
+        {NULL, NULL}
+    };
+
+    cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)variables);
+
     struct retro_get_proc_address_interface get_proc_if = {zx48k_get_proc};
     cb(RETRO_ENVIRONMENT_SET_PROC_ADDRESS_CALLBACK, &get_proc_if);
 }
 
 void retro_set_video_refresh(retro_video_refresh_t const cb) {
-    zx48k.video_cb = cb;
+    zx48k_frontend.video_cb = cb;
 }
 
 void retro_set_audio_sample(retro_audio_sample_t const cb) {
@@ -162,35 +585,74 @@ void retro_set_audio_sample(retro_audio_sample_t const cb) {
 }
 
 void retro_set_audio_sample_batch(retro_audio_sample_batch_t const cb) {
-    zx48k.audio_cb = cb;
+    zx48k_frontend.audio_cb = cb;
 }
 
 void retro_set_input_poll(retro_input_poll_t const cb) {
-    zx48k.input_poll_cb = cb;
+    zx48k_frontend.input_poll_cb = cb;
 }
 
 void retro_set_input_state(retro_input_state_t const cb) {
-    zx48k.input_state_cb = cb;
+    zx48k_frontend.input_state_cb = cb;
 }
 
 void retro_init() {
-    zx48k.log_cb = dummy_log;
+    zx48k_frontend.log_cb = dummy_log;
 
     struct retro_log_callback log;
 
-    if (zx48k.env_cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &log)) {
-        zx48k.log_cb = log.log;
+    if (zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &log)) {
+        zx48k_frontend.log_cb = log.log;
+    }
+
+    /* Have the frontend push key events instead of polling every key each frame */
+    struct retro_keyboard_callback kbd_cb = {zx48k_keyboard_cb};
+    zx48k_frontend.has_keyboard_cb = zx48k_frontend.env_cb(RETRO_ENVIRONMENT_SET_KEYBOARD_CALLBACK, &kbd_cb);
+
+    bool can_dupe = false;
+    zx48k_frontend.can_dupe = zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe) && can_dupe;
+
+    /* The emulator's palette is RGBA8 in memory, the frontend wants XRGB8888 */
+    uint32_t const* const palette = zx_palette();
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t const color = palette[i];
+        zx48k_xrgb_palette[i] = (color & 0xff00ff00) | ((color & 0x00ff0000) >> 16) | ((color & 0x000000ff) << 16);
     }
 
-    zx48k_reset();
+    zx48k = (zx48k_t*)aligned_alloc(_Alignof(zx48k_t), sizeof(*zx48k));
+
+    if (zx48k == NULL) {
+        zx48k_frontend.log_cb(RETRO_LOG_ERROR, "Error allocating memory for the emulator\n");
+        return;
+    }
+
+    memset(zx48k, 0, sizeof(*zx48k));
+
+    zx48k->frontend = &zx48k_frontend;
+    zx48k->log_cb = zx48k_frontend.log_cb;
+
+    zx48k_read_variables(zx48k);
+
+    zx48k_init(zx48k);
+    zx48k_boot(zx48k);
 }
 
 void retro_deinit(void) {
-    if (zx48k.data != NULL) {
-        free((void*)zx48k.data);
-        zx48k.data = NULL;
-        zx48k.size = 0;
+#ifdef ZX48K_TRACE
+    char const* path = getenv("ZX48K_TRACE_FILE");
+
+    if (path == NULL) {
+        path = "zx48k_trace.json";
+    }
+
+    if (!zx48k_trace_flush(path)) {
+        zx48k_frontend.log_cb(RETRO_LOG_ERROR, "Error writing trace to \"%s\"\n", path);
     }
+#endif
+
+    zx48k_destroy(zx48k);
+    zx48k = NULL;
 }
 
 unsigned retro_api_version() {
@@ -206,10 +668,10 @@ void retro_get_system_info(struct retro_system_info* const info) {
 }
 
 void retro_get_system_av_info(struct retro_system_av_info* const info) {
-    info->geometry.base_width = zx48k.width;
-    info->geometry.base_height = zx48k.height;
-    info->geometry.max_width = zx48k.width;
-    info->geometry.max_height = zx48k.height;
+    info->geometry.base_width = zx48k->width;
+    info->geometry.base_height = zx48k->height;
+    info->geometry.max_width = ZX_MAX_DISPLAY_WIDTH;
+    info->geometry.max_height = ZX_MAX_DISPLAY_HEIGHT;
     info->geometry.aspect_ratio = 0.0f;
     info->timing.fps = ZX48K_FRAMES_PER_SECOND;
     info->timing.sample_rate = 44100.0;
@@ -221,112 +683,377 @@ void retro_set_controller_port_device(unsigned const port, unsigned const device
 }
 
 void retro_reset(void) {
-    zx48k_reset();
-
-    if (zx48k.data != NULL && !zx_quickload(&zx48k.zx, zx48k.data, zx48k.size)) {
-        zx48k.log_cb(RETRO_LOG_ERROR, "Error reloading content in retro_reset");
-    }
+    zx48k_reset(zx48k);
 }
 
 bool retro_load_game(struct retro_game_info const* const info) {
-    if (info == NULL) {
+    if (info == NULL || zx48k == NULL) {
         return false;
     }
 
-    enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+    /* RGB565 halves what goes to the frontend, use the other format if the frontend doesn't take the one asked for */
+    struct retro_variable var = {"zx48k_pixel_format", NULL};
+    bool const rgb565 = zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value != NULL && !strcmp(var.value, "rgb565");
 
-    if (!zx48k.env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
-        zx48k.log_cb( RETRO_LOG_ERROR, "XRGB8888 is not supported\n" );
-        return false;
+    enum retro_pixel_format fmt = rgb565 ? RETRO_PIXEL_FORMAT_RGB565 : RETRO_PIXEL_FORMAT_XRGB8888;
+
+    if (!zx48k_frontend.env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
+        fmt = rgb565 ? RETRO_PIXEL_FORMAT_XRGB8888 : RETRO_PIXEL_FORMAT_RGB565;
+
+        if (!zx48k_frontend.env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
+            zx48k_frontend.log_cb(RETRO_LOG_ERROR, "Neither XRGB8888 nor RGB565 are supported\n");
+            return false;
+        }
     }
 
-    bool const ok = zx48k_load(info->data, info->size);
+    zx48k_frontend.rgb565 = fmt == RETRO_PIXEL_FORMAT_RGB565;
+    zx48k_frontend.pixel_size = zx48k_frontend.rgb565 ? 2 : 4;
+
+    /* The frames already expanded are in the previous format, the renderer is created again by retro_run */
+    zx48k_renderer_destroy(zx48k->renderer);
+    zx48k->renderer = NULL;
+
+    bool const ok = zx48k_load(zx48k, info->data, info->size);
 
     struct retro_memory_descriptor desc[4] = {
-        {RETRO_MEMDESC_CONST,      zx48k.zx.rom[0], 0, 0x0000, 0, 0, 0x4000, NULL},
-        {RETRO_MEMDESC_SYSTEM_RAM, zx48k.zx.ram[0], 0, 0x4000, 0, 0, 0x4000, NULL},
-        {RETRO_MEMDESC_SYSTEM_RAM, zx48k.zx.ram[1], 0, 0x8000, 0, 0, 0x4000, NULL},
-        {RETRO_MEMDESC_SYSTEM_RAM, zx48k.zx.ram[2], 0, 0xc000, 0, 0, 0x4000, NULL}
+        {RETRO_MEMDESC_CONST,      (void*)zx48k->zx.rom[0], 0, 0x0000, 0, 0, 0x4000, NULL},
+        {RETRO_MEMDESC_SYSTEM_RAM, zx48k->zx.ram[0], 0, 0x4000, 0, 0, 0x4000, NULL},
+        {RETRO_MEMDESC_SYSTEM_RAM, zx48k->zx.ram[1], 0, 0x8000, 0, 0, 0x4000, NULL},
+        {RETRO_MEMDESC_SYSTEM_RAM, zx48k->zx.ram[2], 0, 0xc000, 0, 0, 0x4000, NULL}
     };
 
     struct retro_memory_map memory_map = {desc, 4};
-    zx48k.env_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &memory_map);
+    zx48k_frontend.env_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &memory_map);
 
     return ok;
 }
 
-void retro_run(void) {
-    zx48k.input_poll_cb();
-
-    /* Update the joystick */
-    static struct {unsigned id; uint8_t mask;} const joy_map[] = {
-        {RETRO_DEVICE_ID_JOYPAD_UP, ZX_JOYSTICK_UP},
-        {RETRO_DEVICE_ID_JOYPAD_DOWN, ZX_JOYSTICK_DOWN},
-        {RETRO_DEVICE_ID_JOYPAD_LEFT, ZX_JOYSTICK_LEFT},
-        {RETRO_DEVICE_ID_JOYPAD_RIGHT, ZX_JOYSTICK_RIGHT},
-        {RETRO_DEVICE_ID_JOYPAD_B, ZX_JOYSTICK_BTN}
-    };
+static void zx48k_update_input(zx48k_t* const self) {
+    zx48k_frontend_t const* const frontend = self->frontend;
+
+    /* Headless machines keep the state given to zx48k_set_input */
+    if (frontend != NULL) {
+        ZX48K_TRACE_BEGIN("input");
 
-    uint8_t joy_mask = 0;
+        frontend->input_poll_cb();
 
-    for (int i = 0; i < sizeof(joy_map) / sizeof(joy_map[0]); i++) {
-        int16_t const pressed = zx48k.input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, joy_map[i].id);
+        /* Update the joystick */
+        static struct {unsigned id; uint8_t mask;} const joy_map[] = {
+            {RETRO_DEVICE_ID_JOYPAD_UP, ZX_JOYSTICK_UP},
+            {RETRO_DEVICE_ID_JOYPAD_DOWN, ZX_JOYSTICK_DOWN},
+            {RETRO_DEVICE_ID_JOYPAD_LEFT, ZX_JOYSTICK_LEFT},
+            {RETRO_DEVICE_ID_JOYPAD_RIGHT, ZX_JOYSTICK_RIGHT},
+            {RETRO_DEVICE_ID_JOYPAD_B, ZX_JOYSTICK_BTN}
+        };
 
-        if (pressed != 0) {
-            joy_mask |= joy_map[i].mask;
+        uint8_t joy_mask = 0;
+
+        for (int i = 0; i < sizeof(joy_map) / sizeof(joy_map[0]); i++) {
+            int16_t const pressed = frontend->input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, joy_map[i].id);
+
+            if (pressed != 0) {
+                joy_mask |= joy_map[i].mask;
+            }
         }
+
+        self->joy_mask = joy_mask;
+
+        /* Update the keyboard, unless the frontend pushes key events to us */
+        if (!frontend->has_keyboard_cb) {
+            uint64_t current_key_states = 0;
+            uint64_t key = 1;
+
+            for (int col = 0; col < 8; col++) {
+                for (int row = 0; row < 5; row++, key <<= 1) {
+                    uint64_t const pressed = -(frontend->input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, zx48k_kbd_map[col][row]) != 0);
+                    current_key_states |= pressed & key;
+                }
+            }
+
+            self->key_states = current_key_states;
+        }
+
+        ZX48K_TRACE_END();
     }
 
-    zx_joystick(&zx48k.zx, joy_mask);
+    /* Replace the whole matrix and joystick state in one go */
+    zx_set_input_state(&self->zx, self->key_states, self->joy_mask);
+}
 
-    /* Update the keyboard */
-    static unsigned const kbd_map[8][5] = {
-        {RETROK_LSHIFT, RETROK_z,     RETROK_x, RETROK_c, RETROK_v},
-        {RETROK_a,      RETROK_s,     RETROK_d, RETROK_f, RETROK_g},
-        {RETROK_q,      RETROK_w,     RETROK_e, RETROK_r, RETROK_t},
-        {RETROK_1,      RETROK_2,     RETROK_3, RETROK_4, RETROK_5},
-        {RETROK_0,      RETROK_9,     RETROK_8, RETROK_7, RETROK_6},
-        {RETROK_p,      RETROK_o,     RETROK_i, RETROK_u, RETROK_y},
-        {RETROK_RETURN, RETROK_l,     RETROK_k, RETROK_j, RETROK_h},
-        {RETROK_SPACE,  RETROK_LCTRL, RETROK_m, RETROK_n, RETROK_b}
-    };
+static void zx48k_input_cb(void* const ud) {
+    zx48k_update_input((zx48k_t*)ud);
+}
 
-    uint64_t current_key_states = 0;
-    uint64_t key = 1;
+/* Emulates one frame, recording its scanlines */
+static void zx48k_exec_frame(zx48k_t* const self) {
+    self->audio_hash = ZX_HASH_SEED;
 
-    for (int col = 0; col < 8; col++) {
-        for (int row = 0; row < 5; row++, key <<= 1) {
-            uint64_t const pressed = -(zx48k.input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, kbd_map[col][row]) != 0);
-            current_key_states |= pressed & key;
+    if (self->late_input) {
+        /* Poll the input only when the game reads the keyboard or joystick */
+        zx_request_input(&self->zx);
+    }
+    else {
+        zx48k_update_input(self);
+    }
+
+    ZX48K_TRACE_BEGIN("zx_exec");
+    ZX48K_STATS_BEGIN(exec);
+    zx_exec(&self->zx, ZX48K_US_PER_FRAME);
+    ZX48K_STATS_END(exec, cpu_ns);
+    ZX48K_TRACE_END();
+
+    if (self->zx.input_requested) {
+        /* The game didn't read any input, but we must poll once per frame */
+        self->zx.input_requested = false;
+        zx48k_update_input(self);
+    }
+}
+
+bool zx48k_skip_video(zx48k_t* const self, bool const skip) {
+    self->skip_video = skip;
+
+    if (skip) {
+        free(self->output);
+        self->output = NULL;
+        return true;
+    }
+
+    return zx48k_get_output(self) != NULL;
+}
+
+void zx48k_run_frame(zx48k_t* const self) {
+#ifdef ZX48K_STATS
+    zx48k_stats_begin_frame(self);
+#endif
+
+    /* Headless machines have no audio, so they don't synthesize it either */
+    zx_skip_output(&self->zx, self->skip_video, self->frontend == NULL);
+    zx48k_exec_frame(self);
+
+#ifdef ZX48K_STATS
+    zx48k_stats_end_frame(self);
+#endif
+}
+
+/* Expands the scanlines that changed since the frame was last expanded, in the frontend's pixel format */
+static void zx48k_expand_frame(zx_scanline_t const* const scanlines, unsigned const num_lines, zx_scanline_t* const expanded,
+                               zx48k_frame_t* const frame) {
+    if (zx48k_frontend.rgb565) {
+        zx_expand_changed_scanlines16(scanlines, num_lines, expanded, frame->pixels16, NULL);
+    }
+    else {
+        zx_expand_changed_scanlines(scanlines, num_lines, expanded, frame->pixels32, zx48k_xrgb_palette);
+    }
+}
+
+static void* zx48k_renderer_thread(void* const arg) {
+    zx48k_renderer_t* const self = (zx48k_renderer_t*)arg;
+
+    pthread_mutex_lock(&self->lock);
+
+    for (;;) {
+        while (!self->busy && !self->quit) {
+            pthread_cond_wait(&self->start, &self->lock);
         }
+
+        if (self->quit) {
+            break;
+        }
+
+        /* The main thread doesn't touch the scanlines and the current frame while busy is set */
+        pthread_mutex_unlock(&self->lock);
+        zx48k_expand_frame(self->scanlines, self->num_lines, self->expanded[self->current], &self->frames[self->current]);
+        pthread_mutex_lock(&self->lock);
+
+        self->busy = false;
+        pthread_cond_signal(&self->done);
     }
 
-    uint64_t const changed_keys = current_key_states ^ zx48k.key_states;
-    key = 1;
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
 
-    for (int code = 128; code < 168; code++, key <<= 1) {
-        if ((changed_keys & key) != 0) {
-            if ((current_key_states & key) != 0) {
-                zx_key_down(&zx48k.zx, code);
-            }
-            else {
-                zx_key_up(&zx48k.zx, code);
-            }
+static zx48k_renderer_t* zx48k_renderer_create(void) {
+    zx48k_renderer_t* const self = (zx48k_renderer_t*)calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->start, NULL);
+    pthread_cond_init(&self->done, NULL);
+    memset(self->expanded, 0xff, sizeof(self->expanded));
+
+    if (pthread_create(&self->thread, NULL, zx48k_renderer_thread, self) != 0) {
+        pthread_cond_destroy(&self->done);
+        pthread_cond_destroy(&self->start);
+        pthread_mutex_destroy(&self->lock);
+        free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+static void zx48k_renderer_destroy(zx48k_renderer_t* const self) {
+    if (self == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    self->quit = true;
+    pthread_cond_signal(&self->start);
+    pthread_mutex_unlock(&self->lock);
+
+    pthread_join(self->thread, NULL);
+
+    pthread_cond_destroy(&self->done);
+    pthread_cond_destroy(&self->start);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
+
+/* Starts expanding the scanlines, returns the previous frame, or this one if there's no previous frame yet */
+static void const* zx48k_renderer_submit(zx48k_renderer_t* const self, zx_scanline_t const* const scanlines, unsigned const num_lines) {
+    ZX48K_TRACE_BEGIN("render_wait");
+    pthread_mutex_lock(&self->lock);
+
+    while (self->busy) {
+        pthread_cond_wait(&self->done, &self->lock);
+    }
+
+    ZX48K_TRACE_END();
+
+    memcpy(self->scanlines, scanlines, num_lines * sizeof(*scanlines));
+    self->num_lines = num_lines;
+    self->current ^= 1;
+    self->busy = true;
+    pthread_cond_signal(&self->start);
+
+    if (self->num_frames++ == 0) {
+        while (self->busy) {
+            pthread_cond_wait(&self->done, &self->lock);
+        }
+
+        pthread_mutex_unlock(&self->lock);
+        return &self->frames[self->current];
+    }
+
+    pthread_mutex_unlock(&self->lock);
+    return &self->frames[self->current ^ 1];
+}
+
+/* Decides whether this frame's picture and audio are needed, returns true if the picture is */
+static bool zx48k_select_output(zx48k_t* const self) {
+    int av_enable = 0;
+
+    if (!zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av_enable)) {
+        av_enable = 3;
+    }
+
+    bool fast_forwarding = false;
+
+    if (!zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_FASTFORWARDING, &fast_forwarding)) {
+        fast_forwarding = false;
+    }
+
+    /* Bit 3 asks for no audio at all, e.g. for the hidden instance when running ahead */
+    bool video = (av_enable & 1) != 0;
+    bool audio = (av_enable & 2) != 0 && (av_enable & 8) == 0;
+
+    if (fast_forwarding && self->fast_forward != ZX48K_FAST_FORWARD_FULL) {
+        audio = false;
+
+        /* Dropped frames must be presented again by the frontend */
+        if (self->fast_forward == ZX48K_FAST_FORWARD_SKIP_FRAMES && zx48k_frontend.can_dupe) {
+            video = video && self->skipped_frames == 0;
+            self->skipped_frames = (self->skipped_frames + 1) % ZX48K_FAST_FORWARD_FRAMESKIP;
+        }
+    }
+    else {
+        self->skipped_frames = 0;
+    }
+
+    zx_skip_output(&self->zx, !video, !audio);
+    return video;
+}
+
+void retro_run(void) {
+    zx48k_t* const self = zx48k;
+
+    ZX48K_TRACE_BEGIN("retro_run");
+
+#ifdef ZX48K_STATS
+    zx48k_stats_begin_frame(self);
+#endif
+
+    bool updated = false;
+
+    if (zx48k_frontend.env_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated) {
+        zx48k_read_variables(self);
+        zx_set_contention(&self->zx, !self->no_contention);
+
+        unsigned const width = self->width;
+        unsigned const height = self->height;
+        zx48k_set_border(self, self->border);
+
+        if (self->width != width || self->height != height) {
+            struct retro_game_geometry geometry = {self->width, self->height, ZX_MAX_DISPLAY_WIDTH, ZX_MAX_DISPLAY_HEIGHT, 0.0f};
+            zx48k_frontend.env_cb(RETRO_ENVIRONMENT_SET_GEOMETRY, &geometry);
+
+            /* The worker's last frame has the old size, it's created again below */
+            zx48k_renderer_destroy(self->renderer);
+            self->renderer = NULL;
         }
     }
 
-    zx48k.key_states = current_key_states;
+    if (self->render_thread && self->renderer == NULL) {
+        self->renderer = zx48k_renderer_create();
 
-    zx_exec(&zx48k.zx, ZX48K_US_PER_FRAME);
+        if (self->renderer == NULL) {
+            zx48k_frontend.log_cb(RETRO_LOG_ERROR, "Error creating the render thread, rendering on the main thread\n");
+            self->render_thread = false;
+        }
+    }
+    else if (!self->render_thread && self->renderer != NULL) {
+        zx48k_renderer_destroy(self->renderer);
+        self->renderer = NULL;
+    }
 
-    uint32_t pixel_buffer[320 * 256];
+    bool const video = zx48k_select_output(self);
+    zx48k_exec_frame(self);
 
-    for (size_t i = 0; i < sizeof(pixel_buffer) / sizeof(pixel_buffer[0]); i++) {
-        uint32_t const pixel = zx48k.pixel_buffer[i];
-        pixel_buffer[i] = (pixel & 0xff00ff00) | ((pixel & 0x00ff0000) >> 16) | ((pixel & 0x000000ff) << 16);
+    ZX48K_STATS_BEGIN(video);
+
+    if (video && self->renderer != NULL) {
+        /* Hand this frame to the worker and present the one it finished */
+        void const* const pixels = zx48k_renderer_submit(self->renderer, self->scanlines, self->height);
+
+        ZX48K_TRACE_BEGIN("video_cb");
+        zx48k_frontend.video_cb(pixels, self->width, self->height, self->width * zx48k_frontend.pixel_size);
+        ZX48K_TRACE_END();
+    }
+    else if (video && zx48k_get_output(self) != NULL) {
+        /* Only the scanlines that changed since the last frame presented are expanded again */
+        zx48k_expand_frame(self->scanlines, self->height, self->output->expanded, &self->output->frame);
+
+        ZX48K_TRACE_BEGIN("video_cb");
+        zx48k_frontend.video_cb(&self->output->frame, self->width, self->height, self->width * zx48k_frontend.pixel_size);
+        ZX48K_TRACE_END();
     }
+    else {
+        /* Either the frontend discards the frame or it presents the previous one again */
+        zx48k_frontend.video_cb(NULL, self->width, self->height, self->width * zx48k_frontend.pixel_size);
+    }
+
+    ZX48K_STATS_END(video, video_ns);
+
+#ifdef ZX48K_STATS
+    zx48k_stats_end_frame(self);
+#endif
 
-    zx48k.video_cb(pixel_buffer, zx48k.width, zx48k.height, zx48k.width * 4);
+    ZX48K_TRACE_END();
 }
 
 size_t retro_serialize_size(void) {
@@ -378,10 +1105,10 @@ size_t retro_get_memory_size(unsigned const id) {
 
 static uint8_t main_region_peek(uint64_t address) {
     switch (address >> 14) {
-        case 0: return zx48k.zx.rom[0][address & 0x3fff];
-        case 1: return zx48k.zx.ram[0][address & 0x3fff];
-        case 2: return zx48k.zx.ram[1][address & 0x3fff];
-        case 3: return zx48k.zx.ram[2][address & 0x3fff];
+        case 0: return zx48k->zx.rom[0][address & 0x3fff];
+        case 1: return zx48k->zx.ram[0][address & 0x3fff];
+        case 2: return zx48k->zx.ram[1][address & 0x3fff];
+        case 3: return zx48k->zx.ram[2][address & 0x3fff];
     }
 
     return 0;
@@ -389,10 +1116,10 @@ static uint8_t main_region_peek(uint64_t address) {
 
 static int main_region_poke(uint64_t address, uint8_t value) {
     switch (address >> 14) {
-        case 0: zx48k.zx.rom[0][address & 0x3fff] = value; break;
-        case 1: zx48k.zx.ram[0][address & 0x3fff] = value; break;
-        case 2: zx48k.zx.ram[1][address & 0x3fff] = value; break;
-        case 3: zx48k.zx.ram[2][address & 0x3fff] = value; break;
+        case 0: return 0; /* the ROM is shared by all machines */
+        case 1: zx48k->zx.ram[0][address & 0x3fff] = value; break;
+        case 2: zx48k->zx.ram[1][address & 0x3fff] = value; break;
+        case 3: zx48k->zx.ram[2][address & 0x3fff] = value; break;
     }
 
     return 1;
@@ -409,44 +1136,44 @@ static hc_Memory const main_region = {
 
 static uint64_t main_get_register(unsigned reg) {
     switch (reg) {
-        case HC_Z80_A: return z80_a(&zx48k.zx.cpu);
-        case HC_Z80_F: return z80_f(&zx48k.zx.cpu);
-        case HC_Z80_BC: return z80_bc(&zx48k.zx.cpu);
-        case HC_Z80_DE: return z80_de(&zx48k.zx.cpu);
-        case HC_Z80_HL: return z80_hl(&zx48k.zx.cpu);
-        case HC_Z80_IX: return z80_ix(&zx48k.zx.cpu);
-        case HC_Z80_IY: return z80_iy(&zx48k.zx.cpu);
-        case HC_Z80_AF2: return z80_af_(&zx48k.zx.cpu);
-        case HC_Z80_BC2: return z80_bc_(&zx48k.zx.cpu);
-        case HC_Z80_DE2: return z80_de_(&zx48k.zx.cpu);
-        case HC_Z80_HL2: return z80_hl_(&zx48k.zx.cpu);
-        case HC_Z80_I: return z80_i(&zx48k.zx.cpu);
-        case HC_Z80_R: return z80_r(&zx48k.zx.cpu);
-        case HC_Z80_SP: return z80_sp(&zx48k.zx.cpu);
-        case HC_Z80_PC: return z80_pc(&zx48k.zx.cpu);
-        case HC_Z80_IFF: return z80_iff1(&zx48k.zx.cpu) << 1 | z80_iff2(&zx48k.zx.cpu);
-        case HC_Z80_IM: return z80_im(&zx48k.zx.cpu);
-        case HC_Z80_WZ: return z80_wz(&zx48k.zx.cpu);
+        case HC_Z80_A: return z80_a(&zx48k->zx.cpu);
+        case HC_Z80_F: return z80_f(&zx48k->zx.cpu);
+        case HC_Z80_BC: return z80_bc(&zx48k->zx.cpu);
+        case HC_Z80_DE: return z80_de(&zx48k->zx.cpu);
+        case HC_Z80_HL: return z80_hl(&zx48k->zx.cpu);
+        case HC_Z80_IX: return z80_ix(&zx48k->zx.cpu);
+        case HC_Z80_IY: return z80_iy(&zx48k->zx.cpu);
+        case HC_Z80_AF2: return z80_af_(&zx48k->zx.cpu);
+        case HC_Z80_BC2: return z80_bc_(&zx48k->zx.cpu);
+        case HC_Z80_DE2: return z80_de_(&zx48k->zx.cpu);
+        case HC_Z80_HL2: return z80_hl_(&zx48k->zx.cpu);
+        case HC_Z80_I: return z80_i(&zx48k->zx.cpu);
+        case HC_Z80_R: return z80_r(&zx48k->zx.cpu);
+        case HC_Z80_SP: return z80_sp(&zx48k->zx.cpu);
+        case HC_Z80_PC: return z80_pc(&zx48k->zx.cpu);
+        case HC_Z80_IFF: return z80_iff1(&zx48k->zx.cpu) << 1 | z80_iff2(&zx48k->zx.cpu);
+        case HC_Z80_IM: return z80_im(&zx48k->zx.cpu);
+        case HC_Z80_WZ: return z80_wz(&zx48k->zx.cpu);
     }
 }
 
 static int main_set_register(unsigned reg, uint64_t value) {
     switch (reg) {
-        case HC_Z80_A: z80_set_a(&zx48k.zx.cpu, value); break;
-        case HC_Z80_F: z80_set_f(&zx48k.zx.cpu, value); break;
-        case HC_Z80_BC: z80_set_bc(&zx48k.zx.cpu, value); break;
-        case HC_Z80_DE: z80_set_de(&zx48k.zx.cpu, value); break;
-        case HC_Z80_HL: z80_set_hl(&zx48k.zx.cpu, value); break;
-        case HC_Z80_IX: z80_set_ix(&zx48k.zx.cpu, value); break;
-        case HC_Z80_IY: z80_set_iy(&zx48k.zx.cpu, value); break;
-        case HC_Z80_AF2: z80_set_af_(&zx48k.zx.cpu, value); break;
-        case HC_Z80_BC2: z80_set_bc_(&zx48k.zx.cpu, value); break;
-        case HC_Z80_DE2: z80_set_de_(&zx48k.zx.cpu, value); break;
-        case HC_Z80_HL2: z80_set_hl_(&zx48k.zx.cpu, value); break;
-        case HC_Z80_I: z80_set_i(&zx48k.zx.cpu, value); break;
-        case HC_Z80_R: z80_set_r(&zx48k.zx.cpu, value); break;
-        case HC_Z80_SP: z80_set_sp(&zx48k.zx.cpu, value); break;
-        case HC_Z80_PC: z80_set_pc(&zx48k.zx.cpu, value); break;
+        case HC_Z80_A: z80_set_a(&zx48k->zx.cpu, value); break;
+        case HC_Z80_F: z80_set_f(&zx48k->zx.cpu, value); break;
+        case HC_Z80_BC: z80_set_bc(&zx48k->zx.cpu, value); break;
+        case HC_Z80_DE: z80_set_de(&zx48k->zx.cpu, value); break;
+        case HC_Z80_HL: z80_set_hl(&zx48k->zx.cpu, value); break;
+        case HC_Z80_IX: z80_set_ix(&zx48k->zx.cpu, value); break;
+        case HC_Z80_IY: z80_set_iy(&zx48k->zx.cpu, value); break;
+        case HC_Z80_AF2: z80_set_af_(&zx48k->zx.cpu, value); break;
+        case HC_Z80_BC2: z80_set_bc_(&zx48k->zx.cpu, value); break;
+        case HC_Z80_DE2: z80_set_de_(&zx48k->zx.cpu, value); break;
+        case HC_Z80_HL2: z80_set_hl_(&zx48k->zx.cpu, value); break;
+        case HC_Z80_I: z80_set_i(&zx48k->zx.cpu, value); break;
+        case HC_Z80_R: z80_set_r(&zx48k->zx.cpu, value); break;
+        case HC_Z80_SP: z80_set_sp(&zx48k->zx.cpu, value); break;
+        case HC_Z80_PC: z80_set_pc(&zx48k->zx.cpu, value); break;
 
         case HC_Z80_IFF:
         case HC_Z80_IM:
@@ -486,5 +1213,5 @@ static void* hc_set_debuggger(hc_DebuggerIf* const debugger_if) {
     debugger_if->core_api_version = HC_API_VERSION;
     debugger_if->v1.system = &hcsystem;
 
-    return &zx48k;
+    return zx48k;
 }
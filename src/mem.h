@@ -202,10 +202,12 @@ typedef struct {
 
 /* a memory instance is a 2-dimensional table of memory pages */
 typedef struct {
+    /* the pages that are actually visible to the emulated CPU, first since
+       every memory access goes through it
+    */
+    mem_page_t page_table[MEM_NUM_PAGES];
     /* memory-mapped layers, layer 0 is highest priority */
     mem_page_t layers[MEM_NUM_LAYERS][MEM_NUM_PAGES];
-    /* the pages that are actually visible to the emulated CPU */
-    mem_page_t page_table[MEM_NUM_PAGES];
     /* a dummy page for currently unmapped memory */
     uint8_t unmapped_page[MEM_PAGE_SIZE];
     /* a write-only 'junk table' for writes to ROM areas */
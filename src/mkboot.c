@@ -0,0 +1,196 @@
+/*
+Boots the 48K ROM headlessly and writes the machine state it ends in as a C header with a .z80 snapshot, which the core
+restores instead of running the RAM test and the system initialisation when it starts without content.
+
+    zx48k_mkboot output.h
+
+The ROM is booted once it waits for the first key press in the editor (WAIT-KEY at 0x15D4), with the copyright message
+on the screen. The snapshot is taken at the start of that instruction, so restoring it resumes the ROM where it was.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHIPS_IMPL
+#include "ay38910.h"
+#include "beeper.h"
+#include "clk.h"
+#include "kbd.h"
+#include "mem.h"
+#include "z80.h"
+#include "zx.h"
+#include "rom.h"
+
+#define WAIT_KEY_ADDR 0x15d4
+#define MAX_FRAMES 500
+#define US_PER_FRAME 20000
+
+static int trap_wait_key(uint16_t const pc, uint32_t const ticks, uint64_t const pins, void* const ud) {
+    (void)ticks;
+    (void)pins;
+    (void)ud;
+    return pc == WAIT_KEY_ADDR;
+}
+
+/* Compresses a 16K page using the .z80 ED ED run-length scheme */
+static size_t compress(uint8_t const* const src, uint8_t* const dst) {
+    size_t in = 0, out = 0;
+
+    while (in < 0x4000) {
+        uint8_t const value = src[in];
+        size_t run = 1;
+
+        while (in + run < 0x4000 && src[in + run] == value && run < 255) {
+            run++;
+        }
+
+        if (run >= 5 || (value == 0xed && run >= 2)) {
+            dst[out++] = 0xed;
+            dst[out++] = 0xed;
+            dst[out++] = run;
+            dst[out++] = value;
+            in += run;
+        }
+        else if (value == 0xed) {
+            /* A single ED must be followed by a byte that's not taken into a block */
+            dst[out++] = 0xed;
+            in++;
+
+            if (in < 0x4000) {
+                dst[out++] = src[in++];
+            }
+        }
+        else {
+            dst[out++] = value;
+            in++;
+        }
+    }
+
+    return out;
+}
+
+/* Builds a version 3 .z80 snapshot of the machine, returns its size */
+static size_t snapshot(zx_t* const sys, uint8_t* const dst) {
+    z80_t* const cpu = &sys->cpu;
+
+    _zx_z80_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.A = z80_a(cpu);
+    hdr.F = z80_f(cpu);
+    hdr.B = z80_b(cpu);
+    hdr.C = z80_c(cpu);
+    hdr.D = z80_d(cpu);
+    hdr.E = z80_e(cpu);
+    hdr.H = z80_h(cpu);
+    hdr.L = z80_l(cpu);
+    hdr.A_ = z80_af_(cpu) >> 8;
+    hdr.F_ = z80_af_(cpu) & 0xff;
+    hdr.B_ = z80_bc_(cpu) >> 8;
+    hdr.C_ = z80_bc_(cpu) & 0xff;
+    hdr.D_ = z80_de_(cpu) >> 8;
+    hdr.E_ = z80_de_(cpu) & 0xff;
+    hdr.H_ = z80_hl_(cpu) >> 8;
+    hdr.L_ = z80_hl_(cpu) & 0xff;
+    hdr.IX_l = z80_ix(cpu) & 0xff;
+    hdr.IX_h = z80_ix(cpu) >> 8;
+    hdr.IY_l = z80_iy(cpu) & 0xff;
+    hdr.IY_h = z80_iy(cpu) >> 8;
+    hdr.SP_l = z80_sp(cpu) & 0xff;
+    hdr.SP_h = z80_sp(cpu) >> 8;
+    hdr.I = z80_i(cpu);
+    hdr.R = z80_r(cpu) & 0x7f;
+    hdr.flags0 = (z80_r(cpu) >> 7) | ((sys->last_fe_out & 7) << 1);
+    hdr.flags1 = z80_im(cpu);
+    hdr.EI = z80_iff1(cpu);
+    hdr.IFF2 = z80_iff2(cpu);
+
+    _zx_z80_ext_header ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.len_l = 54;
+    ext.PC_l = z80_pc(cpu) & 0xff;
+    ext.PC_h = z80_pc(cpu) >> 8;
+    ext.hw_mode = 0;     /* 48K */
+
+    size_t size = 0;
+    memcpy(dst + size, &hdr, sizeof(hdr));
+    size += sizeof(hdr);
+    memcpy(dst + size, &ext, 2 + 54);
+    size += 2 + 54;
+
+    /* Pages 8, 4 and 5 hold 0x4000, 0x8000 and 0xc000 on the 48K */
+    static uint8_t const page_nrs[3] = {8, 4, 5};
+
+    for (int i = 0; i < 3; i++) {
+        _zx_z80_page_header* const phdr = (_zx_z80_page_header*)(dst + size);
+        size += sizeof(*phdr);
+
+        size_t const length = compress(sys->ram[i], dst + size);
+        phdr->len_l = length & 0xff;
+        phdr->len_h = length >> 8;
+        phdr->page_nr = page_nrs[i];
+        size += length;
+    }
+
+    return size;
+}
+
+int main(int const argc, char const* const argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s output.h\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static zx_t sys;
+    static uint8_t ram[3][0x4000];
+    static uint32_t pixel_buffer[320 * 256];
+
+    zx_init(&sys, &(zx_desc_t) {
+        .type = ZX_TYPE_48K,
+        .pixel_buffer = pixel_buffer,
+        .pixel_buffer_size = sizeof(pixel_buffer),
+        .ram = ram,
+        .ram_size = sizeof(ram),
+        .share_roms = true,
+        .rom_zx48k = rom,
+        .rom_zx48k_size = rom_len
+    });
+
+    z80_trap_cb(&sys.cpu, trap_wait_key, NULL);
+    int frames = 0;
+
+    while (sys.cpu.trap_id == 0) {
+        if (++frames > MAX_FRAMES) {
+            fprintf(stderr, "The ROM didn't reach WAIT-KEY after %d frames\n", MAX_FRAMES);
+            return EXIT_FAILURE;
+        }
+
+        zx_exec(&sys, US_PER_FRAME);
+    }
+
+    static uint8_t data[0x4000 * 3 * 2];
+    size_t const size = snapshot(&sys, data);
+
+    FILE* const file = fopen(argv[1], "w");
+
+    if (file == NULL) {
+        fprintf(stderr, "Error writing \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(file, "/* Generated by zx48k_mkboot from rom.h, the 48K ROM after %d frames, don't edit */\n", frames);
+    fprintf(file, "static uint8_t const boot[] = {");
+
+    for (size_t i = 0; i < size; i++) {
+        fprintf(file, "%s0x%02x,", i % 12 == 0 ? "\n  " : " ", data[i]);
+    }
+
+    fprintf(file, "\n};\n\nstatic size_t const boot_len = %zu;\n", size);
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error writing \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -389,14 +389,15 @@ typedef struct {
 
 /* Z80 CPU state */
 typedef struct {
+    /* everything z80_exec() loads on entry, in one 64-byte cache line */
     z80_tick_t tick_cb;
+    void* user_data;
+    z80_trap_t trap_cb;
     uint64_t bc_de_hl_fa;
     uint64_t bc_de_hl_fa_;
     uint64_t wz_ix_iy_sp;
     uint64_t im_ir_pc_bits;     
     uint64_t pins;              /* only for debug inspection */
-    void* user_data;
-    z80_trap_t trap_cb;
     void* trap_user_data;
     int trap_id;                /* != 0 if a trap has been hit */
 } z80_t;
@@ -18,6 +18,52 @@
     ~~~
         your own assert macro (default: assert(c))
 
+    ~~~C
+    ZX_STATS
+    ~~~
+        if defined, zx_t has a zx_stats_t member with event counters
+        that are updated while the emulator runs, otherwise the counters
+        aren't compiled in at all
+
+    ~~~C
+    ZX_STATS_NOW()
+    ~~~
+        with ZX_STATS defined, a host timestamp in nanoseconds used to
+        time the video rendering (default: 0)
+
+    ~~~C
+    ZX_TRACE_BEGIN(name)
+    ZX_TRACE_END()
+    ~~~
+        optional hooks called around the video rendering, name is a
+        string literal (default: empty)
+
+    ## Video rendering
+
+    The tick callback doesn't decode any video, it only counts scanlines.
+    Changes the CPU makes behind the beam, i.e. to parts of the frame
+    that were already passed, are logged as video events: border color
+    changes, display bank switches and writes to display bytes the beam
+    passed, each with the beam position it happened at, as a scanline
+    and an 8 pixel column (4 T-states). The passed scanlines are rendered
+    in one pass at the end of each frame and at the end of zx_exec(),
+    with the events undone and replayed so every column sees the machine
+    state it had when the beam passed it. Scanlines without a change in
+    the middle are decoded as a whole, the others in spans between the
+    changes, so border stripes and multicolor effects show up where the
+    hardware would draw them. When the event log is full the passed
+    scanlines are rendered early, which gives the same frame. A frame
+    with bulk writes to the screen can log thousands of events, so the
+    log isn't sized for a whole frame: 256 events (4 KB of zx_t) take
+    the border effects and sprite updates of typical programs without
+    an early render, and the bulk writers render a few times per frame.
+
+    Only the part of the frame given by zx_desc_t.border is decoded: the
+    256x192 display area alone, with a 32 pixel border on each side
+    (320x256, the default), or with all of the border the hardware shows
+    (352x312 on the 48K, 352x311 on the 128). Without a border the border
+    scanlines are skipped and border color changes aren't logged.
+
     You need to include the following headers before including zx.h:
 
     - chips/z80.h
@@ -27,6 +73,26 @@
     - chips/kbd.h
     - chips/clk.h
 
+    ## Display RAM observations
+
+    zx_copy_display(), zx_copy_ink_plane() and zx_copy_attrs() copy the
+    display RAM the ULA shows, as it is when they're called, in compact
+    linear forms for consumers that don't need pixels. They read the RAM
+    bank directly and don't decode or expand any scanlines.
+
+    ## Hashes
+
+    zx_frame_hash(), zx_audio_hash() and zx_state_hash() return 64-bit
+    hashes of the picture, the pending audio samples and the machine
+    state, to check cheaply that a change to the emulator doesn't change
+    what it does. The frame hash covers the recorded scanlines, i.e. the
+    display bytes and border colors the beam showed, not the pixels made
+    from them. The state hash only covers state the emulated program can
+    observe or that changes what it does, not the sound synthesis, so it
+    doesn't depend on whether audio is skipped. The hashes read memory
+    in host byte order, so they're only comparable between hosts of the
+    same endianness.
+
     ## The ZX Spectrum 48K
 
     TODO!
@@ -35,10 +101,26 @@
 
     TODO! 
 
-    ## TODO:
-    - wait states when CPU accesses 'contended memory' and IO ports
-    - reads from port 0xFF must return 'current VRAM bytes
-    - video decoding only has scanline accuracy, not pixel accuracy
+    ## Contended memory
+
+    The ULA has priority over the CPU when both access the display RAM,
+    so memory accesses to 0x4000..0x7FFF (and on the 128 the odd RAM
+    banks mapped at 0xC000) and IO accesses to the ULA ports get wait
+    states while the ULA fetches the display bytes. The wait states for
+    each T-state in the frame come from a constant table per model,
+    the tick callback only looks them up. Only memory and IO machine
+    cycles are delayed, not the internal cycles of an instruction that
+    keep an address on the bus. Set zx_desc_t.disable_contention or call
+    zx_set_contention() to run without wait states.
+
+    ## Floating bus
+
+    Reading a port no device answers, like 0xFF, returns the byte the
+    ULA is fetching from the display RAM at that moment, or 0xFF while
+    it doesn't fetch anything. A constant table per model maps each
+    T-state in the frame to the offset of the display byte the ULA
+    fetches, so such reads take one lookup. The table can answer other
+    questions about what the beam does at a T-state as well.
 
     ## zlib/libpng license
 
@@ -60,13 +142,17 @@
 #*/
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define ZX_MAX_AUDIO_SAMPLES (1024)      /* max number of audio samples in internal sample buffer */
+#define ZX_MAX_VIDEO_EVENTS (256)        /* max number of changes behind the beam before rendering early */
 #define ZX_DEFAULT_AUDIO_SAMPLES (128)   /* default number of samples in internal sample buffer */ 
+#define ZX_MAX_DISPLAY_WIDTH (352)       /* frame width in pixels with the full border */
+#define ZX_MAX_DISPLAY_HEIGHT (312)      /* frame height in scanlines with the full border */
 
 /* ZX Spectrum models */
 typedef enum {
@@ -82,6 +168,13 @@ typedef enum {
     ZX_JOYSTICKTYPE_SINCLAIR_2,
 } zx_joystick_type_t;
 
+/* how much of the border is decoded */
+typedef enum {
+    ZX_BORDER_SMALL,    /* 32 pixels on each side, a 320x256 frame */
+    ZX_BORDER_NONE,     /* only the 256x192 display area */
+    ZX_BORDER_FULL,     /* 48 pixels left and right, 64 (63 on the 128) scanlines above and 56 below */
+} zx_border_t;
+
 /* joystick mask bits */
 #define ZX_JOYSTICK_RIGHT   (1<<0)
 #define ZX_JOYSTICK_LEFT    (1<<1)
@@ -91,15 +184,32 @@ typedef enum {
 
 /* audio sample data callback */
 typedef void (*zx_audio_callback_t)(const float* samples, int num_samples, void* user_data);
+/* input callback, called on the first keyboard or joystick read after zx_request_input() */
+typedef void (*zx_input_callback_t)(void* user_data);
+
+/* one scanline of the frame as the ULA showed it, zx_expand_scanlines() turns it into pixels */
+typedef struct {
+    uint8_t border;             /* border color 0..7 */
+    uint8_t border_split;       /* nonzero if the border color changed within the line, then border_cells is used */
+    uint8_t num_cells;          /* 8 pixel columns in the line, the 32 of the display area and the border on both sides */
+    uint8_t display;            /* nonzero on the 192 display scanlines */
+    uint8_t pixels[32];         /* display bytes, only on the display scanlines */
+    uint8_t attrs[32];          /* attribute bytes with flashing resolved, bit 7 is always clear */
+    uint8_t border_cells[ZX_MAX_DISPLAY_WIDTH/8];   /* border color of each 8 pixel column, only with border_split */
+} zx_scanline_t;
 
 /* config parameters for zx_init() */
 typedef struct {
     zx_type_t type;                     /* default is ZX_TYPE_48K */
     zx_joystick_type_t joystick_type;   /* what joystick to emulate, default is ZX_JOYSTICK_NONE */
+    bool disable_contention;            /* don't inject the wait states of contended memory and IO accesses */
 
     /* video output config */
-    void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 320*256*4 bytes */
+    zx_border_t border;         /* default is ZX_BORDER_SMALL */
+    void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, big enough for the frame with the border given */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    zx_scanline_t* scanlines;   /* optional, scanlines recorded instead of decoding pixel_buffer, see zx_expand_scanlines(),
+                                   one for each scanline of the frame, ZX_MAX_DISPLAY_HEIGHT to allow any border */
 
     /* optional user-data for callback functions */
     void* user_data;
@@ -111,6 +221,22 @@ typedef struct {
     float audio_beeper_volume;      /* volume of the ZX48K beeper: 0.0..1.0, default is 0.25 */
     float audio_ay_volume;          /* volume of the ZX128 AY sound chip: 0.0..1.0, default is 0.5 */
 
+    /* optional input callback for late input polling, see zx_request_input() */
+    zx_input_callback_t input_cb;
+
+    /* memory for the RAM banks (3 on the 48K, 8 on the 128), followed by the
+       ROM copies unless share_roms is set, at least zx_ram_size() bytes,
+       it must stay valid for as long as the instance is used
+    */
+    void* ram;
+    size_t ram_size;
+
+    /* map the ROM images below in place instead of copying them into the
+       ram buffer, so instances can share one read-only copy, the images must
+       then stay valid for as long as the instance is used
+    */
+    bool share_roms;
+
     /* ROMs for ZX Spectrum 48K */
     const void* rom_zx48k;
     int rom_zx48k_size;
@@ -122,52 +248,138 @@ typedef struct {
     int rom_zx128_1_size;
 } zx_desc_t;
 
-/* ZX emulator state */
+#ifdef ZX_STATS
+/* event counters, only with ZX_STATS defined */
 typedef struct {
-    z80_t cpu;
-    beeper_t beeper;
-    ay38910_t ay;
-    bool valid;
-    zx_type_t type;
-    zx_joystick_type_t joystick_type;
-    bool memory_paging_disabled;
-    uint8_t kbd_joymask;        /* joystick mask from keyboard joystick emulation */
-    uint8_t joy_joymask;        /* joystick mask from zx_joystick() */
+    uint64_t ticks;             /* T-states executed */
+    uint64_t instructions;      /* opcode fetches, not counting prefix bytes */
+    uint64_t mem_reads;         /* memory read machine cycles */
+    uint64_t mem_writes;        /* memory write machine cycles */
+    uint64_t io_cycles;         /* IO read and write machine cycles */
+    uint64_t wait_states;       /* T-states the CPU waited on contended memory and IO accesses */
+    uint64_t tick_callbacks;    /* tick callback invocations */
+    uint64_t audio_callbacks;   /* audio callback invocations */
+    uint64_t scanlines;         /* scanlines decoded into the pixel buffer */
+    uint64_t video_ns;          /* host nanoseconds spent decoding scanlines */
+} zx_stats_t;
+#endif
+
+/* a change to the video state behind the beam */
+typedef enum {
+    ZX_VIDEO_EVENT_VRAM,        /* ptr is a uint8_t display byte */
+    ZX_VIDEO_EVENT_BORDER,      /* ptr is zx_t.border_color */
+    ZX_VIDEO_EVENT_BANK,        /* ptr is zx_t.display_ram_bank */
+} zx_video_event_type_t;
+
+typedef struct {
+    void* ptr;
+    uint32_t value;             /* the other value, swapped with *ptr when replaying */
+    uint16_t scanline;          /* the scanline the beam was on */
+    uint8_t cell;               /* the first 8 pixel column of the scanline drawn after the change */
+    uint8_t type;
+} zx_video_event_t;
+
+#ifdef __cplusplus
+#define _ZX_ALIGNAS(n) alignas(n)
+#else
+#define _ZX_ALIGNAS(n) _Alignas(n)
+#endif
+
+/* ZX emulator state, the state touched by the tick callback comes first
+   so it shares as few cache lines as possible, large buffers come last,
+   allocate it with 64 byte alignment for the first line to be a real one
+*/
+typedef struct {
+    /* hot: touched on every tick, the first cache line */
+    _ZX_ALIGNAS(64) int scanline_counter;
+    int scanline_period;
     uint32_t tick_count;
-    uint8_t last_mem_config;        /* last out to 0x7FFD */
+    int sample_pos;
+    int num_samples;
+    zx_type_t type;
+    bool valid;
+    bool input_requested;           /* input_cb pending until the next keyboard/joystick read */
     uint8_t last_fe_out;            /* last out value to 0xFE port */
-    uint8_t blink_counter;          /* incremented on each vblank */
+    uint8_t kbd_joymask;            /* joystick mask from keyboard joystick emulation */
+    uint8_t joy_joymask;            /* joystick mask from zx_joystick() */
+    bool skip_video;                /* see zx_skip_output() */
+    bool skip_audio;
+    uint8_t contended_pages;        /* bit n set if the memory at n*0x4000 is contended */
+    uint32_t border_color;          /* 0..7 */
+    uint16_t scanline_y;            /* the next scanline in the frame */
+    uint16_t rendered_y;            /* the scanlines before this one are rendered */
+    zx_audio_callback_t audio_cb;
+    zx_input_callback_t input_cb;
+    void* user_data;
+    /* hot: the CPU state loaded by z80_exec() from the second cache line,
+       the beeper ticked on every T-state and the tick counters
+    */
+    _ZX_ALIGNAS(64) z80_t cpu;
+    beeper_t beeper;
+    #ifdef ZX_STATS
+    zx_stats_t stats;
+    #endif
+    /* hot: the memory, its page table comes first and is read on every memory access */
+    _ZX_ALIGNAS(64) mem_t mem;
+    /* warm: touched once per scanline, IO access or frame */
+    uint32_t* pixel_buffer;
+    zx_scanline_t* scanlines;
     int frame_scan_lines;
     int top_border_scanlines;
-    int scanline_period;
-    int scanline_counter;
-    int scanline_y;
+    zx_border_t border;
+    int border_cells;               /* 8 pixel border columns left and right of the display area */
+    int display_cells;              /* 8 pixel columns of each scanline, border included */
+    int display_top;                /* border scanlines above the display area */
+    int display_lines;              /* scanlines in the frame, border included */
     uint32_t display_ram_bank;
-    uint32_t border_color;
+    uint8_t blink_counter;          /* incremented on each vblank */
+    uint8_t last_mem_config;        /* last out to 0x7FFD */
+    bool memory_paging_disabled;
+    zx_joystick_type_t joystick_type;
+    const uint8_t* contention;      /* wait states by T-state in the frame, NULL without contention */
+    const uint16_t* ula_fetch;      /* display byte offset the ULA fetches by T-state in the frame, 0x8000 set if any */
+    uint8_t* ram[8];                /* RAM banks in zx_desc_t.ram, NULL if the model doesn't have them */
+    const uint8_t* rom[2];          /* the ROMs mapped into memory */
     clk_t clk;
+    /* large */
     kbd_t kbd;
-    mem_t mem;
-    uint32_t* pixel_buffer;
-    void* user_data;
-    zx_audio_callback_t audio_cb;
-    int num_samples;
-    int sample_pos;
+    ay38910_t ay;
+    int num_video_events;
+    zx_video_event_t video_events[ZX_MAX_VIDEO_EVENTS];
     float sample_buffer[ZX_MAX_AUDIO_SAMPLES];
-    uint8_t ram[8][0x4000];
-    uint8_t rom[2][0x4000];
-    uint8_t junk[0x4000];
 } zx_t;
 
+/* layout checks, a reordered or grown hot field shows up here instead of in the profiler */
+#ifdef __cplusplus
+#define _ZX_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#define _ZX_ALIGNOF(t) alignof(t)
+#else
+#define _ZX_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#define _ZX_ALIGNOF(t) _Alignof(t)
+#endif
+_ZX_STATIC_ASSERT(_ZX_ALIGNOF(zx_t) == 64, "zx_t: must be aligned to a cache line");
+_ZX_STATIC_ASSERT(offsetof(zx_t, cpu) == 64, "zx_t: the tick state must fit the first cache line");
+_ZX_STATIC_ASSERT(offsetof(zx_t, beeper) == 64 + sizeof(z80_t), "zx_t: the beeper must follow the CPU");
+_ZX_STATIC_ASSERT(offsetof(zx_t, mem) < offsetof(zx_t, pixel_buffer), "zx_t: the page table must come before the warm state");
+_ZX_STATIC_ASSERT(offsetof(z80_t, trap_user_data) <= 64, "z80_t: the exec state must fit one cache line");
+_ZX_STATIC_ASSERT(offsetof(mem_t, page_table) == 0, "mem_t: the page table must come first");
+_ZX_STATIC_ASSERT(sizeof(zx_t) - offsetof(zx_t, sample_buffer) - sizeof(float) * ZX_MAX_AUDIO_SAMPLES < 64, "zx_t: the sample buffer must come last");
+#undef _ZX_STATIC_ASSERT
+#undef _ZX_ALIGNOF
+#undef _ZX_ALIGNAS
+
+/* get the size of the memory zx_init() needs in zx_desc_t.ram */
+size_t zx_ram_size(const zx_desc_t* desc);
 /* initialize a new ZX Spectrum instance */
 void zx_init(zx_t* sys, const zx_desc_t* desc);
 /* discard a ZX Spectrum instance */
 void zx_discard(zx_t* sys);
-/* get the standard framebuffer width and height in pixels */
+/* get the standard framebuffer width and height in pixels, with the default border */
 int zx_std_display_width(void);
 int zx_std_display_height(void);
 /* get the maximum framebuffer size in number of bytes */
 int zx_max_display_size(void);
-/* get the current framebuffer width and height in pixels */
+/* get the current framebuffer width and height in pixels, depending on the border */
 int zx_display_width(zx_t* sys);
 int zx_display_height(zx_t* sys);
 /* reset a ZX Spectrum instance */
@@ -184,8 +396,46 @@ void zx_set_joystick_type(zx_t* sys, zx_joystick_type_t type);
 zx_joystick_type_t zx_joystick_type(zx_t* sys);
 /* set joystick mask (combination of ZX_JOYSTICK_*) */
 void zx_joystick(zx_t* sys, uint8_t mask);
+/* call the input callback right before the next keyboard or joystick port read */
+void zx_request_input(zx_t* sys);
+/* replace the whole keyboard matrix (bit column*5+line set for pressed keys) and the joystick mask */
+void zx_set_input_state(zx_t* sys, uint64_t matrix_bits, uint8_t joy_mask);
 /* load a ZX Z80 file into the emulator */
 bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes); 
+/* decode num_lines recorded scanlines into a pixel buffer, with a palette of 16 colors indexed by color | bright<<3, NULL for zx_palette() */
+void zx_expand_scanlines(const zx_scanline_t* lines, int num_lines, uint32_t* pixels, const uint32_t* palette);
+/* like zx_expand_scanlines(), but only for the scanlines that differ from the ones in expanded, which are copied there,
+   returns the number of scanlines expanded, fill expanded with 0xFF bytes to expand all of them
+*/
+int zx_expand_changed_scanlines(const zx_scanline_t* lines, int num_lines, zx_scanline_t* expanded, uint32_t* pixels, const uint32_t* palette);
+/* the same for a 16-bit pixel buffer, NULL for the RGB565 palette of zx_palette565() */
+int zx_expand_changed_scanlines16(const zx_scanline_t* lines, int num_lines, zx_scanline_t* expanded, uint16_t* pixels, const uint16_t* palette);
+/* the default RGBA8 palette, normal brightness colors first */
+const uint32_t* zx_palette(void);
+/* get the RGB565 version of the color palette */
+const uint16_t* zx_palette565(void);
+/* stop decoding the picture and/or synthesizing audio, e.g. while fast-forwarding, timing and interrupts stay exact */
+void zx_skip_output(zx_t* sys, bool video, bool audio);
+/* enable/disable the wait states of contended memory and IO accesses */
+void zx_set_contention(zx_t* sys, bool enabled);
+/* change how much of the border is decoded, the whole frame is decoded again from the current video state */
+void zx_set_border(zx_t* sys, zx_border_t border);
+/* copy the 6144 bitmap bytes in linear order, 32 bytes per pixel row from the top, followed by the 768 attribute bytes */
+void zx_copy_display(zx_t* sys, uint8_t* dst);
+/* write the 256x192 1-bpp plane of pixels showing the ink color, 32 bytes per pixel row, flashing applied */
+void zx_copy_ink_plane(zx_t* sys, uint8_t* dst);
+/* copy the 32x24 attribute bytes */
+void zx_copy_attrs(zx_t* sys, uint8_t* dst);
+/* the initial value for zx_hash() */
+#define ZX_HASH_SEED (0xCBF29CE484222325ULL)
+/* fold size bytes into a 64-bit hash */
+uint64_t zx_hash(uint64_t hash, const void* data, size_t size);
+/* hash of the frame, the recorded scanlines of the current border, or the display RAM and border color without them */
+uint64_t zx_frame_hash(zx_t* sys);
+/* hash of the samples in the audio buffer that weren't passed to the audio callback yet */
+uint64_t zx_audio_hash(zx_t* sys);
+/* hash of the machine state: CPU registers, RAM, ULA, memory paging, beam position, clock, beeper level and AY registers */
+uint64_t zx_state_hash(zx_t* sys);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -199,41 +449,102 @@ bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes);
     #define CHIPS_ASSERT(c) assert(c)
 #endif
 
+#ifdef ZX_STATS
+    #ifndef ZX_STATS_NOW
+        #define ZX_STATS_NOW() (0)
+    #endif
+    #define _ZX_STATS_ADD(sys,field,n) (sys)->stats.field += (n)
+#else
+    #define _ZX_STATS_ADD(sys,field,n)
+#endif
+
+#ifndef ZX_TRACE_BEGIN
+    #define ZX_TRACE_BEGIN(name)
+#endif
+#ifndef ZX_TRACE_END
+    #define ZX_TRACE_END()
+#endif
+
+/* the rarely taken paths of the tick callback are kept out of it, inlining them there slows down every tick */
+#if defined(_MSC_VER)
+    #define _ZX_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+    #define _ZX_NOINLINE __attribute__((noinline))
+#else
+    #define _ZX_NOINLINE
+#endif
+
 #define _ZX_DISPLAY_WIDTH (320)
 #define _ZX_DISPLAY_HEIGHT (256)
-#define _ZX_DISPLAY_SIZE (_ZX_DISPLAY_WIDTH*_ZX_DISPLAY_HEIGHT*4)
+#define _ZX_MAX_DISPLAY_SIZE (ZX_MAX_DISPLAY_WIDTH*ZX_MAX_DISPLAY_HEIGHT*4)
 #define _ZX_48K_FREQUENCY (3500000)
 #define _ZX_128_FREQUENCY (3546894)
+#define _ZX_48K_FRAME_TICKS (312*224)
+#define _ZX_128_FRAME_TICKS (311*228)
+/* IO contention can look up a few T-states past the end of the frame */
+#define _ZX_CONTENTION_PADDING (32)
+/* set in the ULA fetch table entries of the T-states the ULA fetches a display byte in */
+#define _ZX_ULA_FETCH (0x8000)
 
 static uint64_t _zx_tick(int num, uint64_t pins, void* user_data);
 static void _zx_init_memory_map(zx_t* sys);
 static void _zx_init_keyboard_matrix(zx_t* sys);
-static bool _zx_decode_scanline(zx_t* sys);
+static void _zx_init_contention(zx_t* sys, bool enabled);
+static void _zx_init_ula_fetch(zx_t* sys);
+static void _zx_init_border(zx_t* sys, zx_border_t border);
+static void _zx_update_contended_pages(zx_t* sys);
+static void _zx_render(zx_t* sys, int end_y);
+static void _zx_decode_scanline(zx_t* sys, zx_scanline_t* line, int y);
 
 #define _ZX_DEFAULT(val,def) (((val) != 0) ? (val) : (def));
 #define _ZX_CLEAR(val) memset(&val, 0, sizeof(val))
 
+size_t zx_ram_size(const zx_desc_t* desc) {
+    CHIPS_ASSERT(desc);
+    const size_t num_ram_banks = (ZX_TYPE_128 == desc->type) ? 8 : 3;
+    const size_t num_roms = desc->share_roms ? 0 : ((ZX_TYPE_128 == desc->type) ? 2 : 1);
+    return (num_ram_banks + num_roms) * 0x4000;
+}
+
 void zx_init(zx_t* sys, const zx_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= _ZX_DISPLAY_SIZE));
+    CHIPS_ASSERT(desc->ram && (desc->ram_size >= zx_ram_size(desc)));
 
     memset(sys, 0, sizeof(zx_t));
     sys->valid = true;
     sys->type = desc->type;
     sys->joystick_type = desc->joystick_type;
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->scanlines = desc->scanlines;
     sys->user_data = desc->user_data;
     sys->audio_cb = desc->audio_cb;
+    sys->input_cb = desc->input_cb;
     sys->num_samples = _ZX_DEFAULT(desc->audio_num_samples, ZX_DEFAULT_AUDIO_SAMPLES);
     CHIPS_ASSERT(sys->num_samples <= ZX_MAX_AUDIO_SAMPLES);
 
+    /* the RAM banks are contiguous, the ROM copies follow them */
+    const int num_ram_banks = (ZX_TYPE_128 == sys->type) ? 8 : 3;
+    uint8_t* mem_ptr = (uint8_t*) desc->ram;
+    memset(mem_ptr, 0, num_ram_banks * 0x4000);
+    for (int i = 0; i < num_ram_banks; i++, mem_ptr += 0x4000) {
+        sys->ram[i] = mem_ptr;
+    }
+
     /* initalize the hardware */
-    sys->border_color = 0xFF000000;
+    sys->border_color = 0;
     if (ZX_TYPE_128 == sys->type) {
         CHIPS_ASSERT(desc->rom_zx128_0 && (desc->rom_zx128_0_size == 0x4000));
         CHIPS_ASSERT(desc->rom_zx128_1 && (desc->rom_zx128_1_size == 0x4000));
-        memcpy(sys->rom[0], desc->rom_zx128_0, 0x4000);
-        memcpy(sys->rom[1], desc->rom_zx128_1, 0x4000);
+        if (desc->share_roms) {
+            sys->rom[0] = (const uint8_t*) desc->rom_zx128_0;
+            sys->rom[1] = (const uint8_t*) desc->rom_zx128_1;
+        }
+        else {
+            memcpy(mem_ptr, desc->rom_zx128_0, 0x4000);
+            memcpy(mem_ptr + 0x4000, desc->rom_zx128_1, 0x4000);
+            sys->rom[0] = mem_ptr;
+            sys->rom[1] = mem_ptr + 0x4000;
+        }
         sys->display_ram_bank = 5;
         sys->frame_scan_lines = 311;
         sys->top_border_scanlines = 63;
@@ -241,13 +552,21 @@ void zx_init(zx_t* sys, const zx_desc_t* desc) {
     }
     else {
         CHIPS_ASSERT(desc->rom_zx48k && (desc->rom_zx48k_size == 0x4000));
-        memcpy(sys->rom[0], desc->rom_zx48k, 0x4000);
+        if (desc->share_roms) {
+            sys->rom[0] = (const uint8_t*) desc->rom_zx48k;
+        }
+        else {
+            memcpy(mem_ptr, desc->rom_zx48k, 0x4000);
+            sys->rom[0] = mem_ptr;
+        }
         sys->display_ram_bank = 0;
         sys->frame_scan_lines = 312;
         sys->top_border_scanlines = 64;
         sys->scanline_period = 224;
     }
     sys->scanline_counter = sys->scanline_period;
+    _zx_init_border(sys, desc->border);
+    CHIPS_ASSERT(desc->scanlines || (desc->pixel_buffer && (desc->pixel_buffer_size >= (sys->display_cells * 8 * sys->display_lines * 4))));
 
     const int cpu_freq = (sys->type == ZX_TYPE_48K) ? _ZX_48K_FREQUENCY : _ZX_128_FREQUENCY;
     clk_init(&sys->clk, cpu_freq);
@@ -272,6 +591,8 @@ void zx_init(zx_t* sys, const zx_desc_t* desc) {
     }
     _zx_init_memory_map(sys);
     _zx_init_keyboard_matrix(sys);
+    _zx_init_contention(sys, !desc->disable_contention);
+    _zx_init_ula_fetch(sys);
     
     z80_set_pc(&sys->cpu, 0x0000);
 }
@@ -290,17 +611,15 @@ int zx_std_display_height(void) {
 }
 
 int zx_max_display_size(void) {
-    return _ZX_DISPLAY_SIZE;
+    return _ZX_MAX_DISPLAY_SIZE;
 }
 
 int zx_display_width(zx_t* sys) {
-    (void)sys;
-    return _ZX_DISPLAY_WIDTH;
+    return sys->display_cells * 8;
 }
 
 int zx_display_height(zx_t* sys) {
-    (void)sys;
-    return _ZX_DISPLAY_HEIGHT;
+    return sys->display_lines;
 }
 
 void zx_reset(zx_t* sys) {
@@ -311,11 +630,15 @@ void zx_reset(zx_t* sys) {
         ay38910_reset(&sys->ay);
     }
     sys->memory_paging_disabled = false;
+    sys->last_mem_config = 0;
     sys->kbd_joymask = 0;
     sys->joy_joymask = 0;
+    sys->input_requested = false;
     sys->last_fe_out = 0;
     sys->scanline_counter = sys->scanline_period;
     sys->scanline_y = 0;
+    sys->rendered_y = 0;
+    sys->num_video_events = 0;
     sys->blink_counter = 0;
     if (sys->type == ZX_TYPE_48K) {
         sys->display_ram_bank = 0;
@@ -324,6 +647,7 @@ void zx_reset(zx_t* sys) {
         sys->display_ram_bank = 5;
     }
     _zx_init_memory_map(sys);
+    _zx_update_contended_pages(sys);
     z80_set_pc(&sys->cpu, 0x0000);
 }
 
@@ -331,10 +655,24 @@ void zx_exec(zx_t* sys, uint32_t micro_seconds) {
     CHIPS_ASSERT(sys && sys->valid);
     uint32_t ticks_to_run = clk_ticks_to_run(&sys->clk, micro_seconds);
     uint32_t ticks_executed = z80_exec(&sys->cpu, ticks_to_run);
+    _zx_render(sys, sys->scanline_y);
     clk_ticks_executed(&sys->clk, ticks_executed);
+    _ZX_STATS_ADD(sys, ticks, ticks_executed);
     kbd_update(&sys->kbd, micro_seconds);
 }
 
+void zx_skip_output(zx_t* sys, bool video, bool audio) {
+    CHIPS_ASSERT(sys && sys->valid);
+    _zx_render(sys, sys->scanline_y);
+    sys->skip_video = video;
+    sys->skip_audio = audio;
+}
+
+void zx_set_contention(zx_t* sys, bool enabled) {
+    CHIPS_ASSERT(sys && sys->valid);
+    _zx_init_contention(sys, enabled);
+}
+
 void zx_key_down(zx_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
     switch (sys->joystick_type) {
@@ -460,100 +798,596 @@ void zx_joystick(zx_t* sys, uint8_t mask) {
     }
 }
 
-static uint32_t _zx_palette[8] = {
-    0xFF000000,     // black
-    0xFFFF0000,     // blue
-    0xFF0000FF,     // red
-    0xFFFF00FF,     // magenta
-    0xFF00FF00,     // green
-    0xFFFFFF00,     // cyan
-    0xFF00FFFF,     // yellow
-    0xFFFFFFFF,     // white
+void zx_request_input(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->input_requested = (0 != sys->input_cb);
+}
+
+/* call the input callback if the running program is about to read input */
+static void _zx_poll_input(zx_t* sys) {
+    if (sys->input_requested) {
+        sys->input_requested = false;
+        sys->input_cb(sys->user_data);
+    }
+}
+
+void zx_set_input_state(zx_t* sys, uint64_t matrix_bits, uint8_t joy_mask) {
+    CHIPS_ASSERT(sys && sys->valid);
+    /* the 8x5 keyboard matrix, 5 bits per column (A8..A15) */
+    uint16_t line_masks[8];
+    for (int col = 0; col < 8; col++) {
+        line_masks[col] = (matrix_bits >> (col*5)) & 0x1F;
+    }
+    /* the Sinclair joystick ports work as normal keys */
+    if (sys->joystick_type == ZX_JOYSTICKTYPE_SINCLAIR_1) {
+        /* keys 1 (left), 2 (right), 3 (down), 4 (up), 5 (fire) */
+        if (joy_mask & ZX_JOYSTICK_LEFT)  { line_masks[3] |= 1<<0; }
+        if (joy_mask & ZX_JOYSTICK_RIGHT) { line_masks[3] |= 1<<1; }
+        if (joy_mask & ZX_JOYSTICK_DOWN)  { line_masks[3] |= 1<<2; }
+        if (joy_mask & ZX_JOYSTICK_UP)    { line_masks[3] |= 1<<3; }
+        if (joy_mask & ZX_JOYSTICK_BTN)   { line_masks[3] |= 1<<4; }
+        sys->joy_joymask = 0;
+    }
+    else if (sys->joystick_type == ZX_JOYSTICKTYPE_SINCLAIR_2) {
+        /* keys 0 (fire), 9 (up), 8 (down), 7 (right), 6 (left) */
+        if (joy_mask & ZX_JOYSTICK_BTN)   { line_masks[4] |= 1<<0; }
+        if (joy_mask & ZX_JOYSTICK_UP)    { line_masks[4] |= 1<<1; }
+        if (joy_mask & ZX_JOYSTICK_DOWN)  { line_masks[4] |= 1<<2; }
+        if (joy_mask & ZX_JOYSTICK_RIGHT) { line_masks[4] |= 1<<3; }
+        if (joy_mask & ZX_JOYSTICK_LEFT)  { line_masks[4] |= 1<<4; }
+        sys->joy_joymask = 0;
+    }
+    else {
+        sys->joy_joymask = joy_mask;
+    }
+    /* this only updates the keyboard scanout state once */
+    kbd_set_matrix(&sys->kbd, line_masks, 8);
+}
+
+/* the palette indexed by color | bright<<3, normal brightness first */
+static uint32_t _zx_palette16[16] = {
+    0xFF000000, 0xFFD70000, 0xFF0000D7, 0xFFD700D7, 0xFF00D700, 0xFFD7D700, 0xFF00D7D7, 0xFFD7D7D7,
+    0xFF000000, 0xFFFF0000, 0xFF0000FF, 0xFFFF00FF, 0xFF00FF00, 0xFFFFFF00, 0xFF00FFFF, 0xFFFFFFFF,
+};
+
+/* the same palette in RGB565 */
+static const uint16_t _zx_palette565[16] = {
+    0x0000, 0x001A, 0xD000, 0xD01A, 0x06A0, 0x06BA, 0xD6A0, 0xD6BA,
+    0x0000, 0x001F, 0xF800, 0xF81F, 0x07E0, 0x07FF, 0xFFE0, 0xFFFF,
+};
+
+/* draws the border in the 8 pixel columns first_cell..end_cell-1, in spans of the same color */
+static uint32_t* _zx_expand_border(const zx_scanline_t* line, int first_cell, int end_cell, uint32_t* dst, const uint32_t* palette) {
+    if (!line->border_split) {
+        const uint32_t border = palette[line->border];
+        for (int x = first_cell*8; x < end_cell*8; x++) {
+            *dst++ = border;
+        }
+        return dst;
+    }
+    int cell = first_cell;
+    while (cell < end_cell) {
+        const uint8_t color = line->border_cells[cell];
+        int end = cell + 1;
+        while ((end < end_cell) && (line->border_cells[end] == color)) {
+            end++;
+        }
+        const uint32_t border = palette[color];
+        for (int x = cell*8; x < end*8; x++) {
+            *dst++ = border;
+        }
+        cell = end;
+    }
+    return dst;
+}
+
+static void _zx_expand_scanline(const zx_scanline_t* line, uint32_t* dst, const uint32_t* palette) {
+    if (!line->display) {
+        /* upper/lower border */
+        _zx_expand_border(line, 0, line->num_cells, dst, palette);
+        return;
+    }
+    /* left border */
+    const int border_cells = (line->num_cells - 32) / 2;
+    dst = _zx_expand_border(line, 0, border_cells, dst, palette);
+    /* valid 256x192 vidmem area */
+    for (int x = 0; x < 32; x++) {
+        const uint8_t pix = line->pixels[x];
+        const uint8_t clr = line->attrs[x];
+        const uint8_t bright = (clr>>3) & 8;
+        const uint32_t fg = palette[(clr & 7) | bright];
+        const uint32_t bg = palette[((clr>>3) & 7) | bright];
+        for (int px = 7; px >=0; px--) {
+            *dst++ = pix & (1<<px) ? fg : bg;
+        }
+    }
+    /* right border */
+    _zx_expand_border(line, border_cells + 32, line->num_cells, dst, palette);
+}
+
+/* the 16-bit versions of _zx_expand_border() and _zx_expand_scanline() */
+static uint16_t* _zx_expand_border16(const zx_scanline_t* line, int first_cell, int end_cell, uint16_t* dst, const uint16_t* palette) {
+    int cell = first_cell;
+    while (cell < end_cell) {
+        const uint8_t color = line->border_split ? line->border_cells[cell] : line->border;
+        int end = line->border_split ? cell + 1 : end_cell;
+        while ((end < end_cell) && (line->border_cells[end] == color)) {
+            end++;
+        }
+        const uint16_t border = palette[color];
+        for (int x = cell*8; x < end*8; x++) {
+            *dst++ = border;
+        }
+        cell = end;
+    }
+    return dst;
+}
+
+/* the pixels set by each 4 bit half of a bitmap byte, to draw 4 pixels at a time */
+static const uint16_t _zx_pixel_masks16[16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 0xFFFF}, {0, 0, 0xFFFF, 0}, {0, 0, 0xFFFF, 0xFFFF},
+    {0, 0xFFFF, 0, 0}, {0, 0xFFFF, 0, 0xFFFF}, {0, 0xFFFF, 0xFFFF, 0}, {0, 0xFFFF, 0xFFFF, 0xFFFF},
+    {0xFFFF, 0, 0, 0}, {0xFFFF, 0, 0, 0xFFFF}, {0xFFFF, 0, 0xFFFF, 0}, {0xFFFF, 0, 0xFFFF, 0xFFFF},
+    {0xFFFF, 0xFFFF, 0, 0}, {0xFFFF, 0xFFFF, 0, 0xFFFF}, {0xFFFF, 0xFFFF, 0xFFFF, 0}, {0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF},
 };
 
+static void _zx_expand_scanline16(const zx_scanline_t* line, uint16_t* dst, const uint16_t* palette) {
+    if (!line->display) {
+        _zx_expand_border16(line, 0, line->num_cells, dst, palette);
+        return;
+    }
+    const int border_cells = (line->num_cells - 32) / 2;
+    dst = _zx_expand_border16(line, 0, border_cells, dst, palette);
+    for (int x = 0; x < 32; x++) {
+        const uint8_t pix = line->pixels[x];
+        const uint8_t clr = line->attrs[x];
+        const uint8_t bright = (clr>>3) & 8;
+        const uint64_t fg = palette[(clr & 7) | bright] * 0x0001000100010001ULL;
+        const uint64_t bg = palette[((clr>>3) & 7) | bright] * 0x0001000100010001ULL;
+        uint64_t mask[2], quad[2];
+        memcpy(&mask[0], _zx_pixel_masks16[pix >> 4], 8);
+        memcpy(&mask[1], _zx_pixel_masks16[pix & 15], 8);
+        quad[0] = (fg & mask[0]) | (bg & ~mask[0]);
+        quad[1] = (fg & mask[1]) | (bg & ~mask[1]);
+        memcpy(dst, quad, 16);
+        dst += 8;
+    }
+    _zx_expand_border16(line, border_cells + 32, line->num_cells, dst, palette);
+}
+
+void zx_expand_scanlines(const zx_scanline_t* lines, int num_lines, uint32_t* pixels, const uint32_t* palette) {
+    CHIPS_ASSERT(lines && pixels);
+    if (!palette) {
+        palette = _zx_palette16;
+    }
+    for (int y = 0; y < num_lines; y++) {
+        _zx_expand_scanline(&lines[y], pixels, palette);
+        pixels += lines[y].num_cells * 8;
+    }
+}
+
+int zx_expand_changed_scanlines(const zx_scanline_t* lines, int num_lines, zx_scanline_t* expanded, uint32_t* pixels, const uint32_t* palette) {
+    CHIPS_ASSERT(lines && expanded && pixels);
+    if (!palette) {
+        palette = _zx_palette16;
+    }
+    int num_expanded = 0;
+    for (int y = 0; y < num_lines; y++) {
+        if (memcmp(&lines[y], &expanded[y], sizeof(zx_scanline_t)) != 0) {
+            _zx_expand_scanline(&lines[y], pixels, palette);
+            expanded[y] = lines[y];
+            num_expanded++;
+        }
+        pixels += lines[y].num_cells * 8;
+    }
+    return num_expanded;
+}
+
+int zx_expand_changed_scanlines16(const zx_scanline_t* lines, int num_lines, zx_scanline_t* expanded, uint16_t* pixels, const uint16_t* palette) {
+    CHIPS_ASSERT(lines && expanded && pixels);
+    if (!palette) {
+        palette = _zx_palette565;
+    }
+    int num_expanded = 0;
+    for (int y = 0; y < num_lines; y++) {
+        if (memcmp(&lines[y], &expanded[y], sizeof(zx_scanline_t)) != 0) {
+            _zx_expand_scanline16(&lines[y], pixels, palette);
+            expanded[y] = lines[y];
+            num_expanded++;
+        }
+        pixels += lines[y].num_cells * 8;
+    }
+    return num_expanded;
+}
+
+const uint32_t* zx_palette(void) {
+    return _zx_palette16;
+}
+
+const uint16_t* zx_palette565(void) {
+    return _zx_palette565;
+}
+
+void zx_set_border(zx_t* sys, zx_border_t border) {
+    CHIPS_ASSERT(sys && sys->valid);
+    _zx_render(sys, sys->scanline_y);
+    _zx_init_border(sys, border);
+    /* the scanlines rendered so far have the old size, and the logged events the old beam positions */
+    sys->num_video_events = 0;
+    for (int y = 0; y < sys->display_lines; y++) {
+        zx_scanline_t tmp;
+        zx_scanline_t* line = sys->scanlines ? &sys->scanlines[y] : &tmp;
+        _zx_decode_scanline(sys, line, y);
+        if (!sys->scanlines) {
+            _zx_expand_scanline(line, &sys->pixel_buffer[y * sys->display_cells * 8], _zx_palette16);
+        }
+    }
+}
+
+/* the offset of the 32 display bytes of pixel row y in the display RAM */
+static inline uint16_t _zx_bitmap_offset(int y) {
+    /* | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0| */
+    return ((y & 0xC0)<<5) | ((y & 0x07)<<8) | ((y & 0x38)<<2);
+}
+
+void zx_copy_display(zx_t* sys, uint8_t* dst) {
+    CHIPS_ASSERT(sys && sys->valid && dst);
+    const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
+    for (int y = 0; y < 192; y++) {
+        memcpy(dst + y * 32, vidmem_bank + _zx_bitmap_offset(y), 32);
+    }
+    memcpy(dst + 0x1800, vidmem_bank + 0x1800, 0x300);
+}
+
+void zx_copy_ink_plane(zx_t* sys, uint8_t* dst) {
+    CHIPS_ASSERT(sys && sys->valid && dst);
+    const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
+    const bool blink = 0 != (sys->blink_counter & 0x10);
+    for (int y = 0; y < 192; y++) {
+        const uint8_t* pixels = vidmem_bank + _zx_bitmap_offset(y);
+        const uint8_t* attrs = vidmem_bank + 0x1800 + ((y & ~0x7)<<2);
+        for (int x = 0; x < 32; x++) {
+            /* set bits are ink, in flashing cells they're inverted during the blink phase */
+            const uint8_t invert = (blink && (attrs[x] & (1<<7))) ? 0xFF : 0x00;
+            *dst++ = pixels[x] ^ invert;
+        }
+    }
+}
+
+void zx_copy_attrs(zx_t* sys, uint8_t* dst) {
+    CHIPS_ASSERT(sys && sys->valid && dst);
+    memcpy(dst, sys->ram[sys->display_ram_bank] + 0x1800, 0x300);
+}
+
+uint64_t zx_hash(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* ptr = (const uint8_t*) data;
+    /* 8 bytes at a time, multiplying by the golden ratio and folding the high bits back in */
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+        ptr += 8;
+        size -= 8;
+    }
+    /* the rest bytewise like FNV-1a */
+    while (size > 0) {
+        hash = (hash ^ *ptr++) * 0x100000001B3ULL;
+        size--;
+    }
+    return hash;
+}
+
+uint64_t zx_frame_hash(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    _zx_render(sys, sys->scanline_y);
+    uint64_t hash = ZX_HASH_SEED;
+    if (!sys->scanlines) {
+        hash = zx_hash(hash, sys->ram[sys->display_ram_bank], 0x1B00);
+        return zx_hash(hash, &sys->border_color, sizeof(sys->border_color));
+    }
+    /* only the bytes a scanline shows, the others can be left over from earlier frames */
+    for (int y = 0; y < sys->display_lines; y++) {
+        const zx_scanline_t* line = &sys->scanlines[y];
+        /* border, border_split, num_cells and display */
+        hash = zx_hash(hash, line, 4);
+        if (line->display) {
+            hash = zx_hash(hash, line->pixels, sizeof(line->pixels) + sizeof(line->attrs));
+        }
+        if (line->border_split) {
+            hash = zx_hash(hash, line->border_cells, line->num_cells);
+        }
+    }
+    return hash;
+}
+
+uint64_t zx_audio_hash(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return zx_hash(ZX_HASH_SEED, sys->sample_buffer, sys->sample_pos * sizeof(float));
+}
+
+uint64_t zx_state_hash(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    const z80_t* cpu = &sys->cpu;
+    const uint64_t regs[4] = { cpu->bc_de_hl_fa, cpu->bc_de_hl_fa_, cpu->wz_ix_iy_sp, cpu->im_ir_pc_bits };
+    uint64_t hash = zx_hash(ZX_HASH_SEED, regs, sizeof(regs));
+    const int num_ram_banks = (ZX_TYPE_128 == sys->type) ? 8 : 3;
+    for (int i = 0; i < num_ram_banks; i++) {
+        hash = zx_hash(hash, sys->ram[i], 0x4000);
+    }
+    /* the beeper and AY counters, samples and DC adjust buffers only advance while the audio isn't skipped */
+    const int32_t ula[12] = {
+        sys->scanline_counter, sys->scanline_y, (int32_t) sys->tick_count, (int32_t) sys->border_color,
+        sys->last_fe_out, (int32_t) sys->display_ram_bank, sys->last_mem_config, sys->memory_paging_disabled,
+        sys->blink_counter, sys->clk.ticks_to_run, sys->clk.overrun_ticks, sys->beeper.state
+    };
+    hash = zx_hash(hash, ula, sizeof(ula));
+    if (ZX_TYPE_128 == sys->type) {
+        hash = zx_hash(hash, &sys->ay.addr, sizeof(sys->ay.addr));
+        hash = zx_hash(hash, sys->ay.reg, sizeof(sys->ay.reg));
+    }
+    return hash;
+}
+
+/* the beam position as scanline<<6 | the first 8 pixel column it hasn't drawn yet
+
+    the pixels of a scanline are drawn 2 per T-state, the left border
+    from 4 T-states per border column before the ULA fetches the first
+    display byte of the line (16 with the default border), so changes
+    made at the end of a line can show up on the left border of the next
+*/
+static inline int _zx_beam_pos(const zx_t* sys) {
+    int y = sys->scanline_y;
+    int t = sys->scanline_period - sys->scanline_counter + sys->border_cells * 4;
+    if (t >= sys->scanline_period) {
+        t -= sys->scanline_period;
+        y++;
+    }
+    int cell = (t + 3) >> 2;
+    if (cell >= sys->display_cells) {
+        cell = 0;
+        y++;
+    }
+    return (y<<6) | cell;
+}
+
+/* logs a change to the video state at beam position pos if the parts of the frame that weren't rendered yet were
+   decoded with the old value
+*/
+static _ZX_NOINLINE void _zx_log_video_event(zx_t* sys, int pos, zx_video_event_type_t type, void* ptr, uint32_t value) {
+    if ((pos <= (sys->rendered_y<<6)) || sys->skip_video) {
+        return;
+    }
+    if (sys->num_video_events == ZX_MAX_VIDEO_EVENTS) {
+        /* the passed scanlines don't need the change logged once they're rendered */
+        _zx_render(sys, sys->scanline_y);
+        if (sys->num_video_events == ZX_MAX_VIDEO_EVENTS) {
+            return;
+        }
+    }
+    zx_video_event_t* ev = &sys->video_events[sys->num_video_events++];
+    ev->ptr = ptr;
+    ev->value = value;
+    ev->scanline = pos >> 6;
+    ev->cell = pos & 63;
+    ev->type = type;
+}
+
+/* logs a CPU write to a display byte that the beam passed, before the write */
+static _ZX_NOINLINE void _zx_log_vram_write(zx_t* sys, uint16_t addr) {
+    uint8_t* bank;
+    if ((addr & 0xC000) == 0x4000) {
+        bank = sys->ram[(sys->type == ZX_TYPE_128) ? 5 : 0];
+    }
+    else if (((addr & 0xC000) == 0xC000) && (sys->type == ZX_TYPE_128) && ((sys->last_mem_config & 5) == 5)) {
+        /* bank 5 or 7 mapped at 0xC000 */
+        bank = sys->ram[sys->last_mem_config & 7];
+    }
+    else {
+        return;
+    }
+    const uint16_t offset = addr & 0x3FFF;
+    int first_y, last_y;
+    if (offset < 0x1800) {
+        /* | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0| */
+        first_y = last_y = sys->top_border_scanlines + (((offset>>5) & 0xC0) | ((offset>>8) & 0x07) | ((offset>>2) & 0x38));
+    }
+    else if (offset < 0x1B00) {
+        /* an attribute byte is shown on 8 scanlines */
+        first_y = sys->top_border_scanlines + (((offset - 0x1800)>>5)<<3);
+        last_y = first_y + 7;
+    }
+    else {
+        return;
+    }
+    if (last_y < sys->rendered_y) {
+        return;
+    }
+    /* the first unrendered position that shows the byte */
+    const int shown_pos = (((first_y > sys->rendered_y) ? first_y : sys->rendered_y)<<6) | ((offset & 31) + sys->border_cells);
+    const int pos = _zx_beam_pos(sys);
+    if (shown_pos < pos) {
+        _zx_log_video_event(sys, pos, ZX_VIDEO_EVENT_VRAM, bank + offset, bank[offset]);
+    }
+}
+
+/* the T-state in the frame of the machine cycle the tick callback was called for */
+static inline int _zx_frame_tick(const zx_t* sys) {
+    return sys->scanline_y * sys->scanline_period + sys->scanline_period - sys->scanline_counter;
+}
+
+/* the wait states of an IO machine cycle
+
+    the ULA contends ports with A0 clear, and the high byte of any port in
+    contended memory, a 'C:n' below waits as on a contended memory access
+    and then takes n T-states, an 'N:n' just takes n T-states:
+
+    high byte contended | A0 | pattern
+    no                  | 1  | N:4
+    no                  | 0  | N:1, C:3
+    yes                 | 1  | C:1, C:1, C:1, C:1
+    yes                 | 0  | C:1, C:3
+*/
+static _ZX_NOINLINE int _zx_io_wait(const zx_t* sys, uint16_t addr) {
+    const uint8_t* contention = sys->contention;
+    const int start = _zx_frame_tick(sys);
+    int t = start;
+    if ((sys->contended_pages >> (addr>>14)) & 1) {
+        if (addr & 1) {
+            for (int i = 0; i < 4; i++) {
+                t += contention[t] + 1;
+            }
+        }
+        else {
+            t += contention[t] + 1;
+            t += contention[t] + 3;
+        }
+    }
+    else if ((addr & 1) == 0) {
+        t += 1;
+        t += contention[t] + 3;
+    }
+    else {
+        return 0;
+    }
+    const int wait = t - start - 4;
+    /* the CPU can only take 7 wait states per machine cycle */
+    return (wait < 7) ? wait : 7;
+}
+
+/* the value of the floating data bus, sampled in the last T-state of the IO machine cycle */
+static inline uint8_t _zx_floating_bus(const zx_t* sys) {
+    const int t = _zx_frame_tick(sys);
+    const uint16_t fetch = sys->ula_fetch[(t > 0) ? t - 1 : 0];
+    return (fetch & _ZX_ULA_FETCH) ? sys->ram[sys->display_ram_bank][fetch & 0x1FFF] : 0xFF;
+}
+
 static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
     zx_t* sys = (zx_t*) user_data;
-    /* video decoding and vblank interrupt */
+    _ZX_STATS_ADD(sys, tick_callbacks, 1);
+    /* the ULA delays accesses to contended memory and IO ports */
+    if (pins & Z80_MREQ) {
+        if ((sys->contended_pages >> (Z80_GET_ADDR(pins)>>14)) & 1) {
+            const int wait = sys->contention[_zx_frame_tick(sys)];
+            Z80_SET_WAIT(pins, wait);
+            num_ticks += wait;
+            _ZX_STATS_ADD(sys, wait_states, wait);
+        }
+    }
+    else if (((pins & (Z80_IORQ|Z80_M1)) == Z80_IORQ) && sys->contention) {
+        const int wait = _zx_io_wait(sys, Z80_GET_ADDR(pins));
+        Z80_SET_WAIT(pins, wait);
+        num_ticks += wait;
+        _ZX_STATS_ADD(sys, wait_states, wait);
+    }
+    /* the beam and vblank interrupt */
     sys->scanline_counter -= num_ticks;
     if (sys->scanline_counter <= 0) {
         sys->scanline_counter += sys->scanline_period;
-        /* decode next video scanline */
-        if (_zx_decode_scanline(sys)) {
-            /* request vblank interrupt */
+        if (++sys->scanline_y >= sys->frame_scan_lines) {
+            /* render the whole frame, start a new one and request vblank interrupt */
+            _zx_render(sys, sys->scanline_y);
+            sys->scanline_y = 0;
+            sys->rendered_y = 0;
+            sys->num_video_events = 0;
+            sys->blink_counter++;
             pins |= Z80_INT;
         }
     }
 
-    /* tick audio systems */
-    for (int i = 0; i < num_ticks; i++) {
-        sys->tick_count++;
-        bool sample_ready = beeper_tick(&sys->beeper);
-        /* the AY-3-8912 chip runs at half CPU frequency */
-        if (sys->type == ZX_TYPE_128) {
-            if (sys->tick_count & 1) {
-                ay38910_tick(&sys->ay);
-            }
-        }
-        if (sample_ready) {
-            float sample = sys->beeper.sample;
+    /* tick audio systems, the CPU can't observe them so they may be skipped */
+    if (sys->skip_audio) {
+        sys->tick_count += num_ticks;
+    }
+    else {
+        for (int i = 0; i < num_ticks; i++) {
+            sys->tick_count++;
+            bool sample_ready = beeper_tick(&sys->beeper);
+            /* the AY-3-8912 chip runs at half CPU frequency */
             if (sys->type == ZX_TYPE_128) {
-                sample += sys->ay.sample;
+                if (sys->tick_count & 1) {
+                    ay38910_tick(&sys->ay);
+                }
             }
-            sys->sample_buffer[sys->sample_pos++] = sample;
-            if (sys->sample_pos == sys->num_samples) {
-                if (sys->audio_cb) {
-                    sys->audio_cb(sys->sample_buffer, sys->num_samples, sys->user_data);
+            if (sample_ready) {
+                float sample = sys->beeper.sample;
+                if (sys->type == ZX_TYPE_128) {
+                    sample += sys->ay.sample;
+                }
+                sys->sample_buffer[sys->sample_pos++] = sample;
+                if (sys->sample_pos == sys->num_samples) {
+                    if (sys->audio_cb) {
+                        _ZX_STATS_ADD(sys, audio_callbacks, 1);
+                        sys->audio_cb(sys->sample_buffer, sys->num_samples, sys->user_data);
+                    }
+                    sys->sample_pos = 0;
                 }
-                sys->sample_pos = 0;
             }
         }
     }
 
     /* memory and IO requests */
     if (pins & Z80_MREQ) {
-        /* a memory request machine cycle
-            FIXME: 'contended memory' accesses should inject wait states
-        */
+        /* a memory request machine cycle */
         const uint16_t addr = Z80_GET_ADDR(pins);
         if (pins & Z80_RD) {
-            Z80_SET_DATA(pins, mem_rd(&sys->mem, addr));
+            const uint8_t data = mem_rd(&sys->mem, addr);
+            Z80_SET_DATA(pins, data);
+            _ZX_STATS_ADD(sys, mem_reads, 1);
+            #ifdef ZX_STATS
+            if ((pins & Z80_M1) && (data != 0xCB) && (data != 0xDD) && (data != 0xED) && (data != 0xFD)) {
+                sys->stats.instructions++;
+            }
+            #endif
         }
         else if (pins & Z80_WR) {
+            if (addr & 0x4000) {
+                /* only 0x4000..0x7FFF and 0xC000..0xFFFF can hold display bytes */
+                _zx_log_vram_write(sys, addr);
+            }
             mem_wr(&sys->mem, addr, Z80_GET_DATA(pins));
+            _ZX_STATS_ADD(sys, mem_writes, 1);
         }
     }
     else if (pins & Z80_IORQ) {
         /* an IO request machine cycle
             see http://problemkaputt.de/zxdocs.htm#zxspectrum for address decoding
         */
+        #ifdef ZX_STATS
+        if (pins & (Z80_RD|Z80_WR)) {
+            sys->stats.io_cycles++;
+        }
+        #endif
         if (pins & Z80_RD) {
-            /* an IO read
-                FIXME: reading from port xxFF should return 'current VRAM data'
-            */
+            /* an IO read */
             if ((pins & Z80_A0) == 0) {
                 /* Spectrum ULA (...............0)
                     Bits 5 and 7 as read by INning from Port 0xfe are always one
                 */
+                _zx_poll_input(sys);
                 uint8_t data = (1<<7)|(1<<5);
                 /* MIC/EAR flags -> bit 6 */
                 if (sys->last_fe_out & (1<<3|1<<4)) {
                     data |= (1<<6);
                 }
                 /* keyboard matrix bits are encoded in the upper 8 bit of the port address */
-                uint16_t column_mask = (~(Z80_GET_ADDR(pins)>>8)) & 0x00FF;
-                const uint16_t kbd_lines = kbd_test_lines(&sys->kbd, column_mask);
+                const uint8_t column_mask = ~(Z80_GET_ADDR(pins)>>8);
+                const uint16_t kbd_lines = kbd_lookup_lines(&sys->kbd, column_mask);
                 data |= (~kbd_lines) & 0x1F;
                 Z80_SET_DATA(pins, data);
             }
             else if ((pins & (Z80_A7|Z80_A6|Z80_A5)) == 0) {
                 /* Kempston Joystick (........000.....) */
+                _zx_poll_input(sys);
                 Z80_SET_DATA(pins, sys->kbd_joymask | sys->joy_joymask);
             }
-            else if (sys->type == ZX_TYPE_128){
+            else if ((sys->type == ZX_TYPE_128) && ((pins & (Z80_A15|Z80_A14|Z80_A1)) == (Z80_A15|Z80_A14))) {
                 /* read from AY-3-8912 (11............0.) */
-                if ((pins & (Z80_A15|Z80_A14|Z80_A1)) == (Z80_A15|Z80_A14)) {
-                    pins = ay38910_iorq(&sys->ay, AY38910_BC1|pins) & Z80_PIN_MASK;
-                }
+                pins = ay38910_iorq(&sys->ay, AY38910_BC1|pins) & Z80_PIN_MASK;
+            }
+            else {
+                /* nothing drives the data bus (e.g. port 0xFF), it holds what the ULA is fetching */
+                Z80_SET_DATA(pins, _zx_floating_bus(sys));
             }
         }
         else if (pins & Z80_WR) {
@@ -566,7 +1400,14 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
                     FIXME:
                         bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
                 */
-                sys->border_color = _zx_palette[data & 7] & 0xFFD7D7D7;
+                const uint32_t border_color = data & 7;
+                if (border_color != sys->border_color) {
+                    /* there's nothing to log without a border */
+                    if (sys->border_cells) {
+                        _zx_log_video_event(sys, _zx_beam_pos(sys), ZX_VIDEO_EVENT_BORDER, &sys->border_color, sys->border_color);
+                    }
+                    sys->border_color = border_color;
+                }
                 sys->last_fe_out = data;
                 beeper_set(&sys->beeper, 0 != (data & (1<<4)));
             }
@@ -578,9 +1419,14 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
                     if (!sys->memory_paging_disabled) {
                         sys->last_mem_config = data;
                         /* bit 3 defines the video scanout memory bank (5 or 7) */
-                        sys->display_ram_bank = (data & (1<<3)) ? 7 : 5;
+                        const uint32_t display_ram_bank = (data & (1<<3)) ? 7 : 5;
+                        if (display_ram_bank != sys->display_ram_bank) {
+                            _zx_log_video_event(sys, _zx_beam_pos(sys), ZX_VIDEO_EVENT_BANK, &sys->display_ram_bank, sys->display_ram_bank);
+                            sys->display_ram_bank = display_ram_bank;
+                        }
                         /* only last memory bank is mappable */
                         mem_map_ram(&sys->mem, 0, 0xC000, 0x4000, sys->ram[data & 0x7]);
+                        _zx_update_contended_pages(sys);
 
                         /* ROM0 or ROM1 */
                         if (data & (1<<4)) {
@@ -614,9 +1460,19 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
     return pins;
 }
 
-static bool _zx_decode_scanline(zx_t* sys) {
-    /* this is called by the timer callback for every PAL line, controlling
-        the vidmem decoding and vblank interrupt
+/* resolves flashing by swapping ink and paper */
+static inline uint8_t _zx_resolve_attr(uint8_t clr, bool blink) {
+    if ((clr & (1<<7)) && blink) {
+        return (clr & (1<<6)) | ((clr & 7)<<3) | ((clr>>3) & 7);
+    }
+    return clr & 0x7F;
+}
+
+static void _zx_decode_scanline(zx_t* sys, zx_scanline_t* line, int y) {
+    /* this is called by _zx_render() for every visible PAL line the beam
+        passed without a change in the middle, with the video state the
+        line had when the beam passed it, y is the line in the decoded
+        frame
 
         detailed information about frame timings is here:
         for 48K:    http://rk.nvg.ntnu.no/sinclair/faq/tech_48.html#48K
@@ -625,88 +1481,260 @@ static bool _zx_decode_scanline(zx_t* sys) {
         one PAL line takes 224 T-states on 48K, and 228 T-states on 128K
         one PAL frame is 312 lines on 48K, and 311 lines on 128K
 
-        decode the next videomem line into the emulator framebuffer,
-        the border area of a real Spectrum is bigger than the emulator
-        (the emu has 32 pixels border on each side, the hardware has:
+        the border area of a real Spectrum is bigger than the emulator's
+        default (32 pixels border on each side), ZX_BORDER_FULL has all
+        of it:
 
         63 or 64 lines top border
         56 border lines bottom border
         48 pixels on each side horizontal border
+
+        without a border the border color isn't recorded, so it doesn't
+        make the line differ from the last one expanded
     */
-    const int top_decode_line = sys->top_border_scanlines - 32;
-    const int btm_decode_line = sys->top_border_scanlines + 192 + 32;
-    if ((sys->scanline_y >= top_decode_line) && (sys->scanline_y < btm_decode_line)) {
-        const uint16_t y = sys->scanline_y - top_decode_line;
-        uint32_t* dst = &sys->pixel_buffer[y * _ZX_DISPLAY_WIDTH];
+    line->border = sys->border_cells ? (uint8_t) sys->border_color : 0;
+    line->border_split = 0;
+    line->num_cells = (uint8_t) sys->display_cells;
+    line->display = (y >= sys->display_top) && (y < sys->display_top + 192);
+    if (line->display) {
+        /* compute video memory Y offset (inside 256x192 area)
+            this is how the 16-bit video memory address is computed
+            from X and Y coordinates:
+            | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0|
+        */
         const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
         const bool blink = 0 != (sys->blink_counter & 0x10);
-        uint32_t fg, bg;
-        if ((y < 32) || (y >= 224)) {
-            /* upper/lower border */
-            for (int x = 0; x < _ZX_DISPLAY_WIDTH; x++) {
-                *dst++ = sys->border_color;
-            }
+        const uint16_t yy = y - sys->display_top;
+        const uint16_t y_offset = ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
+        const uint16_t clr_offset = 0x1800 + ((yy & ~0x7)<<2);
+        memcpy(line->pixels, vidmem_bank + y_offset, 32);
+        for (int x = 0; x < 32; x++) {
+            line->attrs[x] = _zx_resolve_attr(vidmem_bank[clr_offset + x], blink);
         }
-        else {
-            /* compute video memory Y offset (inside 256x192 area)
-                this is how the 16-bit video memory address is computed
-                from X and Y coordinates:
-                | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0|
-            */
-            const uint16_t yy = y-32;
-            const uint16_t y_offset = ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
-
-            /* left border */
-            for (int x = 0; x < (4*8); x++) {
-                *dst++ = sys->border_color;
-            }
+    }
+}
 
-            /* valid 256x192 vidmem area */
-            for (uint16_t x = 0; x < 32; x++) {
-                const uint16_t pix_offset = y_offset | x;
-                const uint16_t clr_offset = 0x1800 + (((yy & ~0x7)<<2) | x);
+/* decodes the 8 pixel columns first_cell..end_cell-1 of a line that changes in the middle, the 32 columns after the
+   left border show the display bytes on the 192 display lines
+*/
+static void _zx_decode_cells(zx_t* sys, zx_scanline_t* line, int y, int first_cell, int end_cell) {
+    const uint8_t border = sys->border_cells ? (uint8_t) sys->border_color : 0;
+    if (first_cell == 0) {
+        line->border = border;
+        line->border_split = 0;
+        line->num_cells = (uint8_t) sys->display_cells;
+        line->display = (y >= sys->display_top) && (y < sys->display_top + 192);
+    }
+    else if (border != line->border) {
+        line->border_split = 1;
+    }
+    memset(&line->border_cells[first_cell], border, end_cell - first_cell);
+    if (line->display) {
+        const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
+        const bool blink = 0 != (sys->blink_counter & 0x10);
+        const uint16_t yy = y - sys->display_top;
+        const uint16_t y_offset = ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
+        const uint16_t clr_offset = 0x1800 + ((yy & ~0x7)<<2);
+        const int left = sys->border_cells;
+        const int first_x = (first_cell > left) ? first_cell - left : 0;
+        const int end_x = (end_cell < left + 32) ? end_cell - left : 32;
+        for (int x = first_x; x < end_x; x++) {
+            line->pixels[x] = vidmem_bank[y_offset + x];
+            line->attrs[x] = _zx_resolve_attr(vidmem_bank[clr_offset + x], blink);
+        }
+    }
+}
 
-                /* pixel mask and color attribute bytes */
-                const uint8_t pix = vidmem_bank[pix_offset];
-                const uint8_t clr = vidmem_bank[clr_offset];
+/* swaps the value in an event with the video state it changed */
+static inline void _zx_swap_video_event(zx_video_event_t* ev) {
+    if (ev->type == ZX_VIDEO_EVENT_VRAM) {
+        const uint8_t value = *(uint8_t*)ev->ptr;
+        *(uint8_t*)ev->ptr = (uint8_t)ev->value;
+        ev->value = value;
+    }
+    else {
+        const uint32_t value = *(uint32_t*)ev->ptr;
+        *(uint32_t*)ev->ptr = ev->value;
+        ev->value = value;
+    }
+}
 
-                /* foreground and background color */
-                if ((clr & (1<<7)) && blink) {
-                    fg = _zx_palette[(clr>>3) & 7];
-                    bg = _zx_palette[clr & 7];
-                }
-                else {
-                    fg = _zx_palette[clr & 7];
-                    bg = _zx_palette[(clr>>3) & 7];
-                }
-                if (0 == (clr & (1<<6))) {
-                    // standard brightness
-                    fg &= 0xFFD7D7D7;
-                    bg &= 0xFFD7D7D7;
-                }
-                for (int px = 7; px >=0; px--) {
-                    *dst++ = pix & (1<<px) ? fg : bg;
+/* renders the scanlines from rendered_y up to end_y, and drops the events that don't change later scanlines */
+static void _zx_render(zx_t* sys, int end_y) {
+    if (sys->rendered_y >= end_y) {
+        return;
+    }
+    const int num_events = sys->num_video_events;
+    zx_video_event_t* events = sys->video_events;
+    /* the events are in beam order, the ones after the start of end_y stay logged */
+    int num_done = 0;
+    while ((num_done < num_events) && (((events[num_done].scanline<<6) | events[num_done].cell) <= (end_y<<6))) {
+        num_done++;
+    }
+    if (!sys->skip_video) {
+        #ifdef ZX_STATS
+        const uint64_t t0 = ZX_STATS_NOW();
+        #endif
+        ZX_TRACE_BEGIN("render");
+        /* undo the changes to get the state at rendered_y, then redo them
+           as the beam positions they happened at come up
+        */
+        for (int i = num_events - 1; i >= 0; i--) {
+            _zx_swap_video_event(&events[i]);
+        }
+        const int top_decode_line = sys->top_border_scanlines - sys->display_top;
+        int i = 0;
+        for (int y = sys->rendered_y; y < end_y; y++) {
+            while ((i < num_events) && ((events[i].scanline < y) || ((events[i].scanline == y) && (events[i].cell == 0)))) {
+                _zx_swap_video_event(&events[i++]);
+            }
+            const int line_y = y - top_decode_line;
+            if ((line_y < 0) || (line_y >= sys->display_lines)) {
+                continue;
+            }
+            _ZX_STATS_ADD(sys, scanlines, 1);
+            zx_scanline_t tmp;
+            zx_scanline_t* line = sys->scanlines ? &sys->scanlines[line_y] : &tmp;
+            if ((i < num_events) && (events[i].scanline == y)) {
+                /* decode the spans between the changes */
+                int cell = 0;
+                while ((i < num_events) && (events[i].scanline == y)) {
+                    _zx_decode_cells(sys, line, line_y, cell, events[i].cell);
+                    cell = events[i].cell;
+                    _zx_swap_video_event(&events[i++]);
                 }
+                _zx_decode_cells(sys, line, line_y, cell, sys->display_cells);
             }
-
-            /* right border */
-            for (int x = 0; x < (4*8); x++) {
-                *dst++ = sys->border_color;
+            else {
+                _zx_decode_scanline(sys, line, line_y);
             }
+            if (!sys->scanlines) {
+                _zx_expand_scanline(line, &sys->pixel_buffer[line_y * sys->display_cells * 8], _zx_palette16);
+            }
+        }
+        while (i < num_events) {
+            _zx_swap_video_event(&events[i++]);
         }
+        ZX_TRACE_END();
+        _ZX_STATS_ADD(sys, video_ns, ZX_STATS_NOW() - t0);
+        if (num_done > 0) {
+            memmove(events, events + num_done, (num_events - num_done) * sizeof(zx_video_event_t));
+        }
+        sys->num_video_events = num_events - num_done;
+    }
+    else {
+        sys->num_video_events = 0;
+    }
+    sys->rendered_y = end_y;
+}
+
+/* the part of the PAL frame that's decoded */
+static void _zx_init_border(zx_t* sys, zx_border_t border) {
+    sys->border = border;
+    switch (border) {
+        case ZX_BORDER_NONE:
+            sys->border_cells = 0;
+            sys->display_top = 0;
+            sys->display_lines = 192;
+            break;
+        case ZX_BORDER_FULL:
+            sys->border_cells = 6;
+            sys->display_top = sys->top_border_scanlines;
+            sys->display_lines = sys->frame_scan_lines;
+            break;
+        default:
+            sys->border_cells = 4;
+            sys->display_top = 32;
+            sys->display_lines = 256;
+            break;
     }
+    sys->display_cells = 32 + 2 * sys->border_cells;
+}
 
-    if (sys->scanline_y++ >= sys->frame_scan_lines) {
-        /* start new frame, request vblank interrupt */
-        sys->scanline_y = 0;
-        sys->blink_counter++;
-        return true;
+/* the odd RAM banks are contended on the 128, only bank 5 is on the 48K */
+static void _zx_update_contended_pages(zx_t* sys) {
+    if (!sys->contention) {
+        sys->contended_pages = 0;
+    }
+    else if ((sys->type == ZX_TYPE_128) && (sys->last_mem_config & 1)) {
+        sys->contended_pages = (1<<1) | (1<<3);
     }
     else {
-        return false;
+        sys->contended_pages = (1<<1);
     }
 }
 
+/* the contention and ULA fetch tables are constant, so machines on different threads can share them
+
+    they're filled by the macros below, which repeat an initializer for
+    each of the 192 display lines: m(first, line_ticks, y) starts with a
+    designator for the first T-state of line y and lists the entries of
+    the line from there, the entries not listed are 0
+*/
+#define _ZX_LINES_4(m, first, line_ticks, y) m(first, line_ticks, (y)) m(first, line_ticks, (y)+1) m(first, line_ticks, (y)+2) m(first, line_ticks, (y)+3)
+#define _ZX_LINES_16(m, first, line_ticks, y) _ZX_LINES_4(m, first, line_ticks, (y)) _ZX_LINES_4(m, first, line_ticks, (y)+4) _ZX_LINES_4(m, first, line_ticks, (y)+8) _ZX_LINES_4(m, first, line_ticks, (y)+12)
+#define _ZX_LINES_64(m, first, line_ticks, y) _ZX_LINES_16(m, first, line_ticks, (y)) _ZX_LINES_16(m, first, line_ticks, (y)+16) _ZX_LINES_16(m, first, line_ticks, (y)+32) _ZX_LINES_16(m, first, line_ticks, (y)+48)
+#define _ZX_LINES_192(m, first, line_ticks) _ZX_LINES_64(m, first, line_ticks, 0) _ZX_LINES_64(m, first, line_ticks, 64) _ZX_LINES_64(m, first, line_ticks, 128)
+
+/* the wait states for each T-state in the frame
+
+    while the ULA fetches the 32 display bytes of one of the 192 display
+    lines, a contended access that starts at the first T-state of an 8
+    T-state group waits 6 T-states, at the next ones 5, 4, 3, 2, 1, 0 and 0
+*/
+#define _ZX_CONTENTION_8 6, 5, 4, 3, 2, 1, 0, 0
+#define _ZX_CONTENTION_32 _ZX_CONTENTION_8, _ZX_CONTENTION_8, _ZX_CONTENTION_8, _ZX_CONTENTION_8
+#define _ZX_CONTENTION_LINE(first, line_ticks, y) [(first) + (y)*(line_ticks)] = _ZX_CONTENTION_32, _ZX_CONTENTION_32, _ZX_CONTENTION_32, _ZX_CONTENTION_32,
+
+static const uint8_t _zx_contention_48k[_ZX_48K_FRAME_TICKS + _ZX_CONTENTION_PADDING] = {
+    _ZX_LINES_192(_ZX_CONTENTION_LINE, 14335, 224)
+};
+static const uint8_t _zx_contention_128[_ZX_128_FRAME_TICKS + _ZX_CONTENTION_PADDING] = {
+    _ZX_LINES_192(_ZX_CONTENTION_LINE, 14361, 228)
+};
+
+/* the display bytes the ULA fetches at each T-state in the frame
+
+    the ULA fetches two display bytes with their attributes in the first
+    4 T-states of each 8 T-state group, 3 T-states after the contention
+    of the group starts, and is idle in the other 4. An entry is the
+    offset of the byte in the display RAM with _ZX_ULA_FETCH set, or 0
+    while the ULA doesn't fetch anything.
+*/
+/* | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0| */
+#define _ZX_ULA_FETCH_PIXELS(y, x) (_ZX_ULA_FETCH | (((y) & 0xC0)<<5) | (((y) & 0x07)<<8) | (((y) & 0x38)<<2) | (x))
+#define _ZX_ULA_FETCH_ATTRS(y, x) (_ZX_ULA_FETCH | (0x1800 + (((y) & ~0x7)<<2)) | (x))
+#define _ZX_ULA_FETCH_8(y, x) \
+    _ZX_ULA_FETCH_PIXELS(y, x), _ZX_ULA_FETCH_ATTRS(y, x), _ZX_ULA_FETCH_PIXELS(y, (x)+1), _ZX_ULA_FETCH_ATTRS(y, (x)+1), 0, 0, 0, 0
+#define _ZX_ULA_FETCH_64(y, x) \
+    _ZX_ULA_FETCH_8(y, (x)), _ZX_ULA_FETCH_8(y, (x)+2), _ZX_ULA_FETCH_8(y, (x)+4), _ZX_ULA_FETCH_8(y, (x)+6)
+#define _ZX_ULA_FETCH_LINE(first, line_ticks, y) \
+    [(first) + (y)*(line_ticks)] = _ZX_ULA_FETCH_64(y, 0), _ZX_ULA_FETCH_64(y, 8), _ZX_ULA_FETCH_64(y, 16), _ZX_ULA_FETCH_64(y, 24),
+
+static const uint16_t _zx_ula_fetch_48k[_ZX_48K_FRAME_TICKS] = {
+    _ZX_LINES_192(_ZX_ULA_FETCH_LINE, 14338, 224)
+};
+static const uint16_t _zx_ula_fetch_128[_ZX_128_FRAME_TICKS] = {
+    _ZX_LINES_192(_ZX_ULA_FETCH_LINE, 14364, 228)
+};
+
+static void _zx_init_contention(zx_t* sys, bool enabled) {
+    if (!enabled) {
+        sys->contention = 0;
+    }
+    else if (sys->type == ZX_TYPE_128) {
+        sys->contention = _zx_contention_128;
+    }
+    else {
+        sys->contention = _zx_contention_48k;
+    }
+    _zx_update_contended_pages(sys);
+}
+
+static void _zx_init_ula_fetch(zx_t* sys) {
+    sys->ula_fetch = (sys->type == ZX_TYPE_128) ? _zx_ula_fetch_128 : _zx_ula_fetch_48k;
+}
+
 static void _zx_init_memory_map(zx_t* sys) {
     mem_init(&sys->mem);
     if (sys->type == ZX_TYPE_128) {
@@ -897,13 +1925,12 @@ bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes) {
                 page_index = -1;
             }
         }
-        uint8_t* dst_ptr;
-        if (-1 == page_index) {
-            dst_ptr = sys->junk;
-        }
-        else {
-            dst_ptr = sys->ram[page_index];
+        if ((-1 == page_index) || (0 == sys->ram[page_index])) {
+            /* skip pages this model doesn't have */
+            ptr += (0xFFFF == src_len) ? 0x4000 : src_len;
+            continue;
         }
+        uint8_t* dst_ptr = sys->ram[page_index];
         if (0xFFFF == src_len) {
             /* FIXME: uncompressed not supported yet */
             return false;
@@ -1000,7 +2027,7 @@ bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes) {
     else {
         z80_set_pc(&sys->cpu, hdr->PC_h<<8|hdr->PC_l);
     }
-    sys->border_color = _zx_palette[(hdr->flags0>>1) & 7] & 0xFFD7D7D7;
+    sys->border_color = (hdr->flags0>>1) & 7;
     return true;
 }
 #endif /* CHIPS_IMPL */
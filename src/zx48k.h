@@ -0,0 +1,198 @@
+#ifndef ZX48K_H__
+#define ZX48K_H__
+
+/*
+Extensions available to frontends and tools via retro_get_proc_address_interface, i.e.
+
+    zx48k_get_stats_t const get_stats = (zx48k_get_stats_t)get_proc_address("zx48k_get_stats");
+
+Hosts linking the core directly can also create any number of independent headless machines, which don't talk to the
+libretro frontend: they produce no audio, read their input from zx48k_set_input, and leave the frame in a pixel buffer
+allocated when first asked for instead of presenting it. Distinct machines can run on different threads at the same time.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Profiling counters, only available when the core is compiled with ZX48K_STATS defined */
+typedef struct {
+    /* Number of retro_run calls */
+    uint64_t frames;
+
+    /* Emulated T-states */
+    uint64_t ticks;
+
+    /* Instructions executed, counted as opcode fetches not including prefix bytes */
+    uint64_t instructions;
+
+    /* Memory read and write machine cycles */
+    uint64_t mem_reads;
+    uint64_t mem_writes;
+
+    /* IO read and write machine cycles */
+    uint64_t io_cycles;
+
+    /* T-states the CPU waited on contended memory and IO accesses */
+    uint64_t wait_states;
+
+    /* Invocations of the emulator's tick callback */
+    uint64_t tick_callbacks;
+
+    /* Invocations of the emulator's audio callback */
+    uint64_t audio_callbacks;
+
+    /* Scanlines decoded into the pixel buffer */
+    uint64_t scanlines;
+
+    /* Host nanoseconds spent in zx_exec minus video decoding and audio output */
+    uint64_t cpu_ns;
+
+    /* Host nanoseconds spent decoding scanlines, and converting and presenting frames */
+    uint64_t video_ns;
+
+    /* Host nanoseconds spent converting and presenting audio samples */
+    uint64_t audio_ns;
+}
+zx48k_counters_t;
+
+typedef struct {
+    /* Counters for the last retro_run */
+    zx48k_counters_t frame;
+
+    /* Counters accumulated since retro_init */
+    zx48k_counters_t total;
+}
+zx48k_stats_t;
+
+/* Returns the profiling counters, NULL if not compiled with ZX48K_STATS */
+typedef zx48k_stats_t const* (*zx48k_get_stats_t)(void);
+
+/* 64-bit hashes to check that a change to the core doesn't change its output */
+typedef struct {
+    /* The display bytes and border colors of the last frame, not its pixels */
+    uint64_t frame;
+
+    /* The audio samples sent to the frontend during the last frame */
+    uint64_t audio;
+
+    /* The CPU registers, RAM and hardware state */
+    uint64_t state;
+}
+zx48k_hashes_t;
+
+/* Returns the hashes after the last retro_run */
+typedef void (*zx48k_get_hashes_t)(zx48k_hashes_t* hashes);
+
+typedef struct zx48k_t zx48k_t;
+
+/* Creates a headless machine booting the ROM, returns NULL when out of memory */
+zx48k_t* zx48k_create(void);
+void zx48k_destroy(zx48k_t* self);
+
+/* Loads a .z80 snapshot, which is copied and reloaded by zx48k_reset, or boots the ROM when data is NULL */
+bool zx48k_load(zx48k_t* self, void const* data, size_t size);
+void zx48k_reset(zx48k_t* self);
+
+/*
+Sets the keys pressed, one bit per key starting at column 0, row 0 of the keyboard matrix, and the Kempston joystick
+buttons: bit 0 right, 1 left, 2 down, 3 up and 4 fire
+*/
+void zx48k_set_input(zx48k_t* self, uint64_t key_states, uint8_t joy_mask);
+
+/* Emulates one frame */
+void zx48k_run_frame(zx48k_t* self);
+
+/*
+Stops decoding the frame when only the display RAM observations are needed and frees the pixels of zx48k_get_pixels,
+which then returns a stale frame. Decoding again allocates the pixels ahead of zx48k_get_pixels, returns false when out
+of memory.
+*/
+bool zx48k_skip_video(zx48k_t* self, bool skip);
+
+/* How much of the border the frame has */
+typedef enum {
+    /* 32 pixels on each side, a 320x256 frame, the default */
+    ZX48K_BORDER_SMALL,
+
+    /* Only the 256x192 display area, the border isn't decoded at all */
+    ZX48K_BORDER_NONE,
+
+    /* The border the hardware shows, a 352x312 frame */
+    ZX48K_BORDER_FULL
+}
+zx48k_border_t;
+
+/* Sets the border from the current frame on, which changes the size returned by zx48k_get_pixels */
+void zx48k_set_border(zx48k_t* self, zx48k_border_t border);
+
+/* Returns the hashes after the last zx48k_run_frame, the audio hash is constant as headless machines have no audio */
+void zx48k_get_hashes(zx48k_t* self, zx48k_hashes_t* hashes);
+
+/*
+Returns the last frame, in the emulator's 0xAABBGGRR format, only the scanlines that changed are converted again. The
+pixels are allocated by the first call, NULL when out of memory.
+*/
+uint32_t const* zx48k_get_pixels(zx48k_t* self, unsigned* width, unsigned* height);
+
+/* What zx48k_get_observation returns, the display modes read the display RAM directly and are much cheaper than pixels */
+typedef enum {
+    /* The frame of zx48k_get_pixels, 4 bytes per pixel */
+    ZX48K_OBSERVATION_PIXELS,
+
+    /* The 6144 bitmap bytes in linear order, 32 bytes per pixel row from the top, then the 768 attribute bytes */
+    ZX48K_OBSERVATION_DISPLAY,
+
+    /* A 256x192 plane with one bit per pixel, most significant bit first, set where the ink color shows */
+    ZX48K_OBSERVATION_INK_PLANE,
+
+    /* The 32x24 attribute bytes, ink in bits 0-2, paper in bits 3-5, bright in bit 6 and flash in bit 7 */
+    ZX48K_OBSERVATION_ATTRS
+}
+zx48k_observation_t;
+
+/* Returns the size in bytes of the machine's observations */
+size_t zx48k_observation_size(zx48k_t const* self, zx48k_observation_t observation);
+
+/* Writes the current observation to dst, which must have zx48k_observation_size bytes, returns false when out of memory */
+bool zx48k_get_observation(zx48k_t* self, zx48k_observation_t observation, void* dst);
+
+/*
+Batches step many headless machines one frame at a time on a pool of threads. Each thread starts with an even share of
+the machines and steals from the others when it runs out, so the batch finishes together even if some machines are
+slower. All memory is allocated by zx48k_batch_create and the setters, stepping doesn't allocate.
+*/
+typedef struct zx48k_batch_t zx48k_batch_t;
+
+typedef struct {
+    uint64_t key_states;
+    uint8_t joy_mask;
+}
+zx48k_input_t;
+
+/* Creates num_envs machines booting the ROM, using num_threads threads (including the caller) or one per CPU if zero */
+zx48k_batch_t* zx48k_batch_create(unsigned num_envs, unsigned num_threads);
+void zx48k_batch_destroy(zx48k_batch_t* batch);
+
+/* Returns one of the batch's machines to load content or reset it, it must not be destroyed */
+zx48k_t* zx48k_batch_get(zx48k_batch_t* batch, unsigned index);
+
+/* Returns the size in bytes of each observation */
+size_t zx48k_batch_observation_size(zx48k_batch_t const* batch);
+
+/*
+Sets what the steps return for each machine, ZX48K_OBSERVATION_PIXELS by default, the machines don't decode their
+frames for the other observations, returns false when out of memory
+*/
+bool zx48k_batch_set_observation(zx48k_batch_t* batch, zx48k_observation_t observation);
+
+/* Sets the border of all machines, which changes the observation size, returns false when out of memory */
+bool zx48k_batch_set_border(zx48k_batch_t* batch, zx48k_border_t border);
+
+/*
+Sets the input of each machine from inputs (if not NULL), emulates one frame on all of them and returns their
+observations one after the other, valid until the next step
+*/
+void const* zx48k_batch_step(zx48k_batch_t* batch, zx48k_input_t const* inputs);
+
+#endif /* ZX48K_H__ */
@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zx48k.h"
+
+typedef struct {
+    /* Next machine to step and the end of this worker's share, the owner and the thieves all take from next */
+    _Alignas(64) atomic_uint next;
+    unsigned begin;
+    unsigned end;
+
+    zx48k_batch_t* batch;
+    unsigned index;
+    pthread_t thread;
+}
+zx48k_worker_t;
+
+struct zx48k_batch_t {
+    /* The machines and their observations, one after the other */
+    zx48k_t** envs;
+    unsigned num_envs;
+    zx48k_observation_t observation;
+    uint8_t* observations;
+    size_t observation_size;
+
+    /* Inputs for the step in progress */
+    zx48k_input_t const* inputs;
+
+    /* Worker 0 is the thread calling zx48k_batch_step */
+    zx48k_worker_t* workers;
+    unsigned num_workers;
+    unsigned num_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;
+    unsigned pending;
+    bool quit;
+};
+
+static void zx48k_batch_step_env(zx48k_batch_t* const batch, unsigned const index) {
+    zx48k_t* const env = batch->envs[index];
+
+    if (batch->inputs != NULL) {
+        zx48k_set_input(env, batch->inputs[index].key_states, batch->inputs[index].joy_mask);
+    }
+
+    zx48k_run_frame(env);
+    zx48k_get_observation(env, batch->observation, batch->observations + index * batch->observation_size);
+}
+
+/* Makes room for the observations after a change of their size */
+static bool zx48k_batch_resize(zx48k_batch_t* const batch) {
+    size_t const observation_size = zx48k_observation_size(batch->envs[0], batch->observation);
+
+    if (observation_size != batch->observation_size) {
+        uint8_t* const observations = (uint8_t*)calloc(batch->num_envs, observation_size);
+
+        if (observations == NULL) {
+            return false;
+        }
+
+        free(batch->observations);
+        batch->observations = observations;
+        batch->observation_size = observation_size;
+    }
+
+    return true;
+}
+
+/* Steps the worker's own machines, then steals from the other workers until everything is done */
+static void zx48k_batch_work(zx48k_batch_t* const batch, unsigned const self) {
+    for (unsigned i = 0; i < batch->num_workers; i++) {
+        zx48k_worker_t* const victim = batch->workers + (self + i) % batch->num_workers;
+
+        for (;;) {
+            unsigned const index = atomic_fetch_add_explicit(&victim->next, 1, memory_order_relaxed);
+
+            if (index >= victim->end) {
+                break;
+            }
+
+            zx48k_batch_step_env(batch, index);
+        }
+    }
+}
+
+static void* zx48k_batch_thread(void* const arg) {
+    zx48k_worker_t* const worker = (zx48k_worker_t*)arg;
+    zx48k_batch_t* const batch = worker->batch;
+    unsigned generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+
+        while (!batch->quit && batch->generation == generation) {
+            pthread_cond_wait(&batch->start, &batch->lock);
+        }
+
+        generation = batch->generation;
+        bool const quit = batch->quit;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (quit) {
+            return NULL;
+        }
+
+        zx48k_batch_work(batch, worker->index);
+
+        pthread_mutex_lock(&batch->lock);
+
+        if (--batch->pending == 0) {
+            pthread_cond_signal(&batch->done);
+        }
+
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+zx48k_batch_t* zx48k_batch_create(unsigned const num_envs, unsigned num_threads) {
+    if (num_envs == 0) {
+        return NULL;
+    }
+
+    if (num_threads == 0) {
+        long const num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = num_cpus > 0 ? num_cpus : 1;
+    }
+
+    if (num_threads > num_envs) {
+        num_threads = num_envs;
+    }
+
+    zx48k_batch_t* const batch = (zx48k_batch_t*)calloc(1, sizeof(*batch));
+
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->start, NULL);
+    pthread_cond_init(&batch->done, NULL);
+
+    batch->envs = (zx48k_t**)calloc(num_envs, sizeof(*batch->envs));
+    batch->workers = (zx48k_worker_t*)aligned_alloc(64, num_threads * sizeof(*batch->workers));
+
+    if (batch->envs == NULL || batch->workers == NULL) {
+        goto error;
+    }
+
+    for (batch->num_envs = 0; batch->num_envs < num_envs; batch->num_envs++) {
+        batch->envs[batch->num_envs] = zx48k_create();
+
+        if (batch->envs[batch->num_envs] == NULL) {
+            goto error;
+        }
+    }
+
+    if (!zx48k_batch_set_observation(batch, ZX48K_OBSERVATION_PIXELS)) {
+        goto error;
+    }
+
+    /* Split the machines evenly, the first workers get one more when they don't divide exactly */
+    batch->num_workers = num_threads;
+
+    for (unsigned i = 0, begin = 0; i < num_threads; i++) {
+        zx48k_worker_t* const worker = batch->workers + i;
+        unsigned const count = num_envs / num_threads + (i < num_envs % num_threads);
+
+        atomic_init(&worker->next, begin);
+        worker->begin = begin;
+        worker->end = begin + count;
+        worker->batch = batch;
+        worker->index = i;
+        begin += count;
+    }
+
+    for (batch->num_threads = 1; batch->num_threads < num_threads; batch->num_threads++) {
+        zx48k_worker_t* const worker = batch->workers + batch->num_threads;
+
+        if (pthread_create(&worker->thread, NULL, zx48k_batch_thread, worker) != 0) {
+            goto error;
+        }
+    }
+
+    return batch;
+
+error:
+    zx48k_batch_destroy(batch);
+    return NULL;
+}
+
+void zx48k_batch_destroy(zx48k_batch_t* const batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->quit = true;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->lock);
+
+    for (unsigned i = 1; i < batch->num_threads; i++) {
+        pthread_join(batch->workers[i].thread, NULL);
+    }
+
+    for (unsigned i = 0; i < batch->num_envs; i++) {
+        zx48k_destroy(batch->envs[i]);
+    }
+
+    pthread_cond_destroy(&batch->done);
+    pthread_cond_destroy(&batch->start);
+    pthread_mutex_destroy(&batch->lock);
+
+    free(batch->observations);
+    free(batch->workers);
+    free(batch->envs);
+    free(batch);
+}
+
+zx48k_t* zx48k_batch_get(zx48k_batch_t* const batch, unsigned const index) {
+    return index < batch->num_envs ? batch->envs[index] : NULL;
+}
+
+size_t zx48k_batch_observation_size(zx48k_batch_t const* const batch) {
+    return batch->observation_size;
+}
+
+bool zx48k_batch_set_border(zx48k_batch_t* const batch, zx48k_border_t const border) {
+    for (unsigned i = 0; i < batch->num_envs; i++) {
+        zx48k_set_border(batch->envs[i], border);
+    }
+
+    return zx48k_batch_resize(batch);
+}
+
+bool zx48k_batch_set_observation(zx48k_batch_t* const batch, zx48k_observation_t const observation) {
+    batch->observation = observation;
+
+    /* Only the pixel observations need the machines' frames, the others free them */
+    for (unsigned i = 0; i < batch->num_envs; i++) {
+        if (!zx48k_skip_video(batch->envs[i], observation != ZX48K_OBSERVATION_PIXELS)) {
+            return false;
+        }
+    }
+
+    return zx48k_batch_resize(batch);
+}
+
+void const* zx48k_batch_step(zx48k_batch_t* const batch, zx48k_input_t const* const inputs) {
+    batch->inputs = inputs;
+
+    for (unsigned i = 0; i < batch->num_workers; i++) {
+        atomic_store_explicit(&batch->workers[i].next, batch->workers[i].begin, memory_order_relaxed);
+    }
+
+    /* The mutex publishes the inputs and the reset ranges to the workers */
+    pthread_mutex_lock(&batch->lock);
+    batch->generation++;
+    batch->pending = batch->num_threads - 1;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->lock);
+
+    zx48k_batch_work(batch, 0);
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->pending != 0) {
+        pthread_cond_wait(&batch->done, &batch->lock);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    return batch->observations;
+}
@@ -0,0 +1,121 @@
+#ifndef ZX48K_TRACE_H__
+#define ZX48K_TRACE_H__
+
+/*
+Optional tracing of the emulator's frame phases, enabled by compiling the core with ZX48K_TRACE defined.
+
+Spans are recorded with zx48k_trace_begin and zx48k_trace_end, which can be nested up to ZX48K_TRACE_MAX_DEPTH levels
+per thread. Each finished span becomes one event in a fixed-size ring buffer, claimed with a single atomic increment so
+any thread can record events without locking. When the ring is full the oldest events are overwritten.
+
+zx48k_trace_flush writes the events to a file in the Chrome trace event format, which can be opened in
+chrome://tracing or https://ui.perfetto.dev. It must only be called when no other thread is recording events.
+*/
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef ZX48K_TRACE_MAX_EVENTS
+#define ZX48K_TRACE_MAX_EVENTS (1 << 18) /* must be a power of two */
+#endif
+
+#define ZX48K_TRACE_MAX_DEPTH 16
+
+typedef struct {
+    char const* name;
+    uint64_t begin_ns;
+    uint64_t duration_ns;
+    unsigned tid;
+}
+zx48k_trace_event_t;
+
+static zx48k_trace_event_t zx48k_trace_events[ZX48K_TRACE_MAX_EVENTS];
+static atomic_uint_fast64_t zx48k_trace_head;
+static atomic_uint zx48k_trace_next_tid;
+
+/* Per-thread stack of open spans */
+static _Thread_local struct {
+    unsigned tid;
+    unsigned depth;
+    char const* names[ZX48K_TRACE_MAX_DEPTH];
+    uint64_t begin_ns[ZX48K_TRACE_MAX_DEPTH];
+}
+zx48k_trace_thread;
+
+static uint64_t zx48k_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void zx48k_trace_begin(char const* const name) {
+    unsigned const depth = zx48k_trace_thread.depth++;
+
+    if (depth < ZX48K_TRACE_MAX_DEPTH) {
+        zx48k_trace_thread.names[depth] = name;
+        zx48k_trace_thread.begin_ns[depth] = zx48k_trace_now();
+    }
+}
+
+static void zx48k_trace_end(void) {
+    unsigned const depth = --zx48k_trace_thread.depth;
+
+    if (depth >= ZX48K_TRACE_MAX_DEPTH) {
+        return;
+    }
+
+    if (zx48k_trace_thread.tid == 0) {
+        zx48k_trace_thread.tid = atomic_fetch_add(&zx48k_trace_next_tid, 1) + 1;
+    }
+
+    uint64_t const index = atomic_fetch_add_explicit(&zx48k_trace_head, 1, memory_order_relaxed);
+    zx48k_trace_event_t* const event = zx48k_trace_events + (index & (ZX48K_TRACE_MAX_EVENTS - 1));
+
+    event->name = zx48k_trace_thread.names[depth];
+    event->begin_ns = zx48k_trace_thread.begin_ns[depth];
+    event->duration_ns = zx48k_trace_now() - event->begin_ns;
+    event->tid = zx48k_trace_thread.tid;
+}
+
+/* Writes the recorded events to path and empties the ring, returns false on error */
+static bool zx48k_trace_flush(char const* const path) {
+    FILE* const file = fopen(path, "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    uint64_t const head = atomic_load(&zx48k_trace_head);
+    uint64_t const first = head > ZX48K_TRACE_MAX_EVENTS ? head - ZX48K_TRACE_MAX_EVENTS : 0;
+
+    /* Events are recorded when they end, so outer spans can begin before the first event in the ring */
+    uint64_t origin_ns = UINT64_MAX;
+
+    for (uint64_t i = first; i < head; i++) {
+        uint64_t const begin_ns = zx48k_trace_events[i & (ZX48K_TRACE_MAX_EVENTS - 1)].begin_ns;
+        origin_ns = begin_ns < origin_ns ? begin_ns : origin_ns;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+
+    for (uint64_t i = first; i < head; i++) {
+        zx48k_trace_event_t const* const event = zx48k_trace_events + (i & (ZX48K_TRACE_MAX_EVENTS - 1));
+
+        fprintf(
+            file,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+            event->name, event->tid, (event->begin_ns - origin_ns) / 1000.0, event->duration_ns / 1000.0,
+            i + 1 < head ? "," : ""
+        );
+    }
+
+    fprintf(file, "],\"displayTimeUnit\":\"ns\"}\n");
+    atomic_store(&zx48k_trace_head, 0);
+
+    return fclose(file) == 0;
+}
+
+#endif /* ZX48K_TRACE_H__ */
@@ -0,0 +1,416 @@
+#pragma once
+/*#
+    # zx_lockstep.h
+
+    EXPERIMENTAL: runs many zx_t instances in instruction lock-step,
+    executing the register-only instructions that several machines are
+    about to run together on structure-of-arrays register banks.
+
+    Do this:
+    ~~~C
+    #define CHIPS_IMPL
+    ~~~
+    before you include this file in *one* C or C++ file to create the
+    implementation, the implementation needs the z80.h and zx.h
+    implementations in the same translation unit.
+
+    You need to include the following headers before including zx_lockstep.h:
+
+    - chips/z80.h
+    - chips/zx.h
+
+    ## How it works
+
+    Each round, the opcode at the PC of every machine that still has ticks
+    to run this frame is peeked, and the machines are bucketed by opcode.
+    For the single byte, 4 T-state register-only opcodes (LD r,r', INC r,
+    DEC r, ALU A,r, the accumulator rotates, CPL, SCF, CCF, EX DE,HL and
+    NOP), the machines in a bucket have their opcode fetch ticked one by
+    one, then their packed bc_de_hl_fa and im_ir_pc_bits banks are
+    gathered into arrays and the instruction runs as one loop over all of
+    them, which the compiler can vectorize, before they're scattered back.
+
+    Everything else (memory and IO accesses, prefixed instructions, HALT,
+    machines with a trap callback, and machines whose fetch could decode
+    a scanline and so raise the vblank interrupt) falls back to running
+    one instruction with z80_exec.
+
+    The result is the same as calling zx_exec on each machine.
+
+    ## zlib/libpng license
+
+    This software is provided 'as-is', without any express or implied warranty.
+    In no event will the authors be held liable for any damages arising from the
+    use of this software.
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+        1. The origin of this software must not be misrepresented; you must not
+        claim that you wrote the original software. If you use this software in a
+        product, an acknowledgment in the product documentation would be
+        appreciated but is not required.
+        2. Altered source versions must be plainly marked as such, and must not
+        be misrepresented as being the original software.
+        3. This notice may not be removed or altered from any source
+        distribution.
+#*/
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ZX_LOCKSTEP_MAX_SYSTEMS (1024)
+
+typedef struct {
+    zx_t* sys[ZX_LOCKSTEP_MAX_SYSTEMS];
+    int num_sys;
+    /* instructions executed on the register arrays and with z80_exec */
+    uint64_t vector_instructions;
+    uint64_t scalar_instructions;
+    /* per-round scratch state */
+    uint32_t ticks_to_run[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint32_t ticks_executed[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint16_t active[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint16_t sorted[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint16_t ops[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint64_t r0[ZX_LOCKSTEP_MAX_SYSTEMS];
+    uint64_t r2[ZX_LOCKSTEP_MAX_SYSTEMS];
+} zx_lockstep_t;
+
+/* initialize with an array of already initialized zx_t instances */
+void zx_lockstep_init(zx_lockstep_t* ls, zx_t* const* sys, int num_sys);
+/* run all instances for a given number of micro-seconds, like zx_exec */
+void zx_lockstep_exec(zx_lockstep_t* ls, uint32_t micro_seconds);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*-- IMPLEMENTATION ----------------------------------------------------------*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+/* bucket for the machines that must run their next instruction with z80_exec */
+#define _ZX_LS_SCALAR (256)
+
+/* the operation of a vectorized opcode */
+enum {
+    _ZX_LS_NONE = 0,
+    _ZX_LS_NOP,
+    _ZX_LS_LD,
+    _ZX_LS_INC,
+    _ZX_LS_DEC,
+    _ZX_LS_ADD,
+    _ZX_LS_ADC,
+    _ZX_LS_SUB,
+    _ZX_LS_SBC,
+    _ZX_LS_AND,
+    _ZX_LS_XOR,
+    _ZX_LS_OR,
+    _ZX_LS_CP,
+    _ZX_LS_RLCA,
+    _ZX_LS_RRCA,
+    _ZX_LS_RLA,
+    _ZX_LS_RRA,
+    _ZX_LS_CPL,
+    _ZX_LS_SCF,
+    _ZX_LS_CCF,
+    _ZX_LS_EXDEHL
+};
+
+/* bit position of B, C, D, E, H, L, (HL) and A in the bc_de_hl_fa bank */
+static const int _zx_ls_reg[8] = { 56, 48, 40, 32, 24, 16, -1, 0 };
+
+#define _ZX_LS_G8(bank,shift) (((bank)>>(shift))&0xFFULL)
+#define _ZX_LS_S8(bank,shift,val) (((bank)&~(0xFFULL<<(shift)))|(((uint64_t)(val)&0xFFULL)<<(shift)))
+#define _ZX_LS_SZ(val) (((val)&0xFF)?((val)&Z80_SF):Z80_ZF)
+#define _ZX_LS_SZYXCH(acc,val,res) (_ZX_LS_SZ(res)|((res)&(Z80_YF|Z80_XF))|(((res)>>8)&Z80_CF)|(((acc)^(val)^(res))&Z80_HF))
+#define _ZX_LS_ADD_FLAGS(acc,val,res) (_ZX_LS_SZYXCH(acc,val,res)|(((((val)^(acc)^0x80)&((val)^(res)))>>5)&Z80_VF))
+#define _ZX_LS_SUB_FLAGS(acc,val,res) (Z80_NF|_ZX_LS_SZYXCH(acc,val,res)|(((((val)^(acc))&((res)^(acc)))>>5)&Z80_VF))
+#define _ZX_LS_CP_FLAGS(acc,val,res) (Z80_NF|(_ZX_LS_SZ(res)|((val)&(Z80_YF|Z80_XF))|(((res)>>8)&Z80_CF)|(((acc)^(val)^(res))&Z80_HF))|(((((val)^(acc))&((res)^(acc)))>>5)&Z80_VF))
+
+/* the operation of an opcode, _ZX_LS_NONE if it must run on the scalar core */
+#define _ZX_LS_KIND(op) ( \
+    (((op) >= 0x40) && ((op) < 0x80)) ? (((((op) & 7) == 6) || ((((op) >> 3) & 7) == 6)) ? _ZX_LS_NONE : _ZX_LS_LD) : \
+    (((op) >= 0x80) && ((op) < 0xC0)) ? ((((op) & 7) == 6) ? _ZX_LS_NONE : (_ZX_LS_ADD + (((op) >> 3) & 7))) : \
+    (((op) < 0x40) && ((((op) >> 3) & 7) != 6) && (((op) & 7) == 4)) ? _ZX_LS_INC : \
+    (((op) < 0x40) && ((((op) >> 3) & 7) != 6) && (((op) & 7) == 5)) ? _ZX_LS_DEC : \
+    ((op) == 0x00) ? _ZX_LS_NOP : \
+    ((op) == 0x07) ? _ZX_LS_RLCA : \
+    ((op) == 0x0F) ? _ZX_LS_RRCA : \
+    ((op) == 0x17) ? _ZX_LS_RLA : \
+    ((op) == 0x1F) ? _ZX_LS_RRA : \
+    ((op) == 0x2F) ? _ZX_LS_CPL : \
+    ((op) == 0x37) ? _ZX_LS_SCF : \
+    ((op) == 0x3F) ? _ZX_LS_CCF : \
+    ((op) == 0xEB) ? _ZX_LS_EXDEHL : _ZX_LS_NONE)
+
+#define _ZX_LS_OPS_4(op) _ZX_LS_KIND(op), _ZX_LS_KIND((op)+1), _ZX_LS_KIND((op)+2), _ZX_LS_KIND((op)+3),
+#define _ZX_LS_OPS_16(op) _ZX_LS_OPS_4(op) _ZX_LS_OPS_4((op)+4) _ZX_LS_OPS_4((op)+8) _ZX_LS_OPS_4((op)+12)
+#define _ZX_LS_OPS_64(op) _ZX_LS_OPS_16(op) _ZX_LS_OPS_16((op)+16) _ZX_LS_OPS_16((op)+32) _ZX_LS_OPS_16((op)+48)
+
+/* the operation of each opcode, built at compile time so that threads can share it */
+static const uint8_t _zx_ls_kind[256] = {
+    _ZX_LS_OPS_64(0x00) _ZX_LS_OPS_64(0x40) _ZX_LS_OPS_64(0x80) _ZX_LS_OPS_64(0xC0)
+};
+
+void zx_lockstep_init(zx_lockstep_t* ls, zx_t* const* sys, int num_sys) {
+    CHIPS_ASSERT(ls && sys && (num_sys > 0) && (num_sys <= ZX_LOCKSTEP_MAX_SYSTEMS));
+    memset(ls, 0, sizeof(*ls));
+    for (int i = 0; i < num_sys; i++) {
+        CHIPS_ASSERT(sys[i] && sys[i]->valid);
+        ls->sys[i] = sys[i];
+    }
+    ls->num_sys = num_sys;
+}
+
+/* returns the opcode a machine can run on the register arrays, or _ZX_LS_SCALAR */
+static uint16_t _zx_ls_peek(zx_t* sys) {
+    z80_t* cpu = &sys->cpu;
+    if (cpu->trap_cb || !z80_opdone(cpu) || (sys->scanline_counter <= 4)) {
+        return _ZX_LS_SCALAR;
+    }
+    const uint8_t op = mem_rd(&sys->mem, z80_pc(cpu));
+    return (_zx_ls_kind[op] != _ZX_LS_NONE) ? op : _ZX_LS_SCALAR;
+}
+
+/* the opcode fetch machine cycle of a vectorized instruction, returns the ticks */
+static uint32_t _zx_ls_fetch(zx_t* sys) {
+    z80_t* cpu = &sys->cpu;
+    uint64_t pins = cpu->pins & ~(Z80_WAIT_MASK|Z80_CTRL_MASK);
+    Z80_SET_ADDR(pins, z80_pc(cpu));
+    pins = cpu->tick_cb(4, pins|Z80_M1|Z80_MREQ|Z80_RD, cpu->user_data);
+    cpu->pins = pins & ~Z80_INT;
+    return 4 + Z80_GET_WAIT(pins);
+}
+
+/* run one register-only instruction on n machines' register banks */
+static void _zx_ls_kernel(uint8_t op, uint64_t* r0, uint64_t* r2, int n) {
+    const int src = _zx_ls_reg[op & 7];
+    const int dst = _zx_ls_reg[(op >> 3) & 7];
+    switch (_zx_ls_kind[op]) {
+        case _ZX_LS_LD:
+            for (int k = 0; k < n; k++) {
+                r0[k] = _ZX_LS_S8(r0[k], dst, _ZX_LS_G8(r0[k], src));
+            }
+            break;
+        case _ZX_LS_INC:
+            for (int k = 0; k < n; k++) {
+                const uint8_t d8 = _ZX_LS_G8(r0[k], dst);
+                const uint8_t r = d8 + 1;
+                uint8_t f = _ZX_LS_SZ(r)|(r&(Z80_XF|Z80_YF))|((r^d8)&Z80_HF);
+                f |= (r == 0x80) ? Z80_VF : 0;
+                f |= _ZX_LS_G8(r0[k], 8) & Z80_CF;
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], dst, r), 8, f);
+            }
+            break;
+        case _ZX_LS_DEC:
+            for (int k = 0; k < n; k++) {
+                const uint8_t d8 = _ZX_LS_G8(r0[k], dst);
+                const uint8_t r = d8 - 1;
+                uint8_t f = Z80_NF|_ZX_LS_SZ(r)|(r&(Z80_XF|Z80_YF))|((r^d8)&Z80_HF);
+                f |= (r == 0x7F) ? Z80_VF : 0;
+                f |= _ZX_LS_G8(r0[k], 8) & Z80_CF;
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], dst, r), 8, f);
+            }
+            break;
+        case _ZX_LS_ADD:
+        case _ZX_LS_ADC:
+            for (int k = 0; k < n; k++) {
+                const uint32_t acc = _ZX_LS_G8(r0[k], 0);
+                const uint32_t d8 = _ZX_LS_G8(r0[k], src);
+                const uint32_t carry = (op & 8) ? (_ZX_LS_G8(r0[k], 8) & Z80_CF) : 0;
+                const uint32_t res = acc + d8 + carry;
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, _ZX_LS_ADD_FLAGS(acc, d8, res)), 0, res);
+            }
+            break;
+        case _ZX_LS_SUB:
+        case _ZX_LS_SBC:
+            for (int k = 0; k < n; k++) {
+                const uint32_t acc = _ZX_LS_G8(r0[k], 0);
+                const uint32_t d8 = _ZX_LS_G8(r0[k], src);
+                const uint32_t carry = (op & 8) ? (_ZX_LS_G8(r0[k], 8) & Z80_CF) : 0;
+                const uint32_t res = (uint32_t)((int)acc - (int)d8 - (int)carry);
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, _ZX_LS_SUB_FLAGS(acc, d8, res)), 0, res);
+            }
+            break;
+        case _ZX_LS_CP:
+            for (int k = 0; k < n; k++) {
+                const uint32_t acc = _ZX_LS_G8(r0[k], 0);
+                const uint32_t d8 = _ZX_LS_G8(r0[k], src);
+                const uint32_t res = (uint32_t)((int)acc - (int)d8);
+                r0[k] = _ZX_LS_S8(r0[k], 8, _ZX_LS_CP_FLAGS(acc, d8, res));
+            }
+            break;
+        case _ZX_LS_AND:
+            for (int k = 0; k < n; k++) {
+                const uint8_t d8 = _ZX_LS_G8(r0[k], src) & _ZX_LS_G8(r0[k], 0);
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, _z80_szp[d8]|Z80_HF), 0, d8);
+            }
+            break;
+        case _ZX_LS_XOR:
+            for (int k = 0; k < n; k++) {
+                const uint8_t d8 = _ZX_LS_G8(r0[k], src) ^ _ZX_LS_G8(r0[k], 0);
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, _z80_szp[d8]), 0, d8);
+            }
+            break;
+        case _ZX_LS_OR:
+            for (int k = 0; k < n; k++) {
+                const uint8_t d8 = _ZX_LS_G8(r0[k], src) | _ZX_LS_G8(r0[k], 0);
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, _z80_szp[d8]), 0, d8);
+            }
+            break;
+        case _ZX_LS_RLCA:
+        case _ZX_LS_RRCA:
+        case _ZX_LS_RLA:
+        case _ZX_LS_RRA:
+            for (int k = 0; k < n; k++) {
+                const uint8_t a = _ZX_LS_G8(r0[k], 0);
+                uint8_t f = _ZX_LS_G8(r0[k], 8);
+                uint8_t r, c;
+                switch (op) {
+                    case 0x07: r = (a<<1)|(a>>7); c = (a>>7)&Z80_CF; break;
+                    case 0x0F: r = (a>>1)|(a<<7); c = a&Z80_CF; break;
+                    case 0x17: r = (a<<1)|(f&Z80_CF); c = (a>>7)&Z80_CF; break;
+                    default:   r = (a>>1)|((f&Z80_CF)<<7); c = a&Z80_CF; break;
+                }
+                f = c|(f&(Z80_SF|Z80_ZF|Z80_PF))|(r&(Z80_YF|Z80_XF));
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, f), 0, r);
+            }
+            break;
+        case _ZX_LS_CPL:
+            for (int k = 0; k < n; k++) {
+                const uint8_t a = _ZX_LS_G8(r0[k], 0) ^ 0xFF;
+                const uint8_t f = (_ZX_LS_G8(r0[k], 8)&(Z80_SF|Z80_ZF|Z80_PF|Z80_CF))|Z80_HF|Z80_NF|(a&(Z80_YF|Z80_XF));
+                r0[k] = _ZX_LS_S8(_ZX_LS_S8(r0[k], 8, f), 0, a);
+            }
+            break;
+        case _ZX_LS_SCF:
+            for (int k = 0; k < n; k++) {
+                const uint8_t a = _ZX_LS_G8(r0[k], 0);
+                const uint8_t f = (_ZX_LS_G8(r0[k], 8)&(Z80_SF|Z80_ZF|Z80_PF|Z80_CF))|Z80_CF|(a&(Z80_YF|Z80_XF));
+                r0[k] = _ZX_LS_S8(r0[k], 8, f);
+            }
+            break;
+        case _ZX_LS_CCF:
+            for (int k = 0; k < n; k++) {
+                const uint8_t a = _ZX_LS_G8(r0[k], 0);
+                const uint8_t f0 = _ZX_LS_G8(r0[k], 8);
+                const uint8_t f = ((f0&(Z80_SF|Z80_ZF|Z80_PF|Z80_CF))|((f0&Z80_CF)<<4)|(a&(Z80_YF|Z80_XF)))^Z80_CF;
+                r0[k] = _ZX_LS_S8(r0[k], 8, f);
+            }
+            break;
+        case _ZX_LS_EXDEHL:
+            for (int k = 0; k < n; k++) {
+                const uint64_t de = (r0[k] >> 32) & 0xFFFF;
+                const uint64_t hl = (r0[k] >> 16) & 0xFFFF;
+                r0[k] = (r0[k] & 0xFFFF00000000FFFFULL) | (hl << 32) | (de << 16);
+            }
+            break;
+        default:
+            break;
+    }
+    /* bump PC and R, and delay-enable interrupts after EI */
+    for (int k = 0; k < n; k++) {
+        uint64_t v = r2[k];
+        const uint64_t pc = (((v >> 16) & 0xFFFF) + 1) & 0xFFFF;
+        const uint64_t r = (v >> 32) & 0xFF;
+        v = (v & ~((0xFFFFULL << 16)|(0xFFULL << 32))) | (pc << 16) | (((r & 0x80)|((r + 1) & 0x7F)) << 32);
+        if (v & (1ULL<<4)) {
+            v = (v & ~(1ULL<<4)) | (1ULL<<2) | (1ULL<<3);
+        }
+        r2[k] = v;
+    }
+}
+
+void zx_lockstep_exec(zx_lockstep_t* ls, uint32_t micro_seconds) {
+    CHIPS_ASSERT(ls && (ls->num_sys > 0));
+    int num_active = 0;
+    for (int i = 0; i < ls->num_sys; i++) {
+        ls->ticks_to_run[i] = clk_ticks_to_run(&ls->sys[i]->clk, micro_seconds);
+        ls->ticks_executed[i] = 0;
+        ls->active[num_active++] = i;
+    }
+    while (num_active > 0) {
+        /* bucket the machines by their next opcode */
+        int start[_ZX_LS_SCALAR + 2] = { 0 };
+        for (int j = 0; j < num_active; j++) {
+            const uint16_t op = _zx_ls_peek(ls->sys[ls->active[j]]);
+            ls->ops[j] = op;
+            start[op + 1]++;
+        }
+        for (int op = 0; op <= _ZX_LS_SCALAR; op++) {
+            start[op + 1] += start[op];
+        }
+        int end[_ZX_LS_SCALAR + 1];
+        memcpy(end, start, sizeof(end));
+        for (int j = 0; j < num_active; j++) {
+            ls->sorted[end[ls->ops[j]]++] = ls->active[j];
+        }
+        /* divergent and unsupported instructions */
+        for (int j = start[_ZX_LS_SCALAR]; j < end[_ZX_LS_SCALAR]; j++) {
+            const int i = ls->sorted[j];
+            z80_t* cpu = &ls->sys[i]->cpu;
+            do {
+                ls->ticks_executed[i] += z80_exec(cpu, 1);
+            } while (!z80_opdone(cpu));
+            ls->scalar_instructions++;
+        }
+        /* one kernel per opcode shared by the machines */
+        for (int op = 0; op < _ZX_LS_SCALAR; op++) {
+            const int n = end[op] - start[op];
+            if (n == 0) {
+                continue;
+            }
+            const uint16_t* lanes = ls->sorted + start[op];
+            for (int k = 0; k < n; k++) {
+                zx_t* sys = ls->sys[lanes[k]];
+                ls->ticks_executed[lanes[k]] += _zx_ls_fetch(sys);
+                ls->r0[k] = sys->cpu.bc_de_hl_fa;
+                ls->r2[k] = sys->cpu.im_ir_pc_bits;
+            }
+            _zx_ls_kernel((uint8_t)op, ls->r0, ls->r2, n);
+            for (int k = 0; k < n; k++) {
+                zx_t* sys = ls->sys[lanes[k]];
+                sys->cpu.bc_de_hl_fa = ls->r0[k];
+                sys->cpu.im_ir_pc_bits = ls->r2[k];
+            }
+            ls->vector_instructions += n;
+        }
+        /* drop the machines that are done with this frame */
+        int num_left = 0;
+        for (int j = 0; j < num_active; j++) {
+            const int i = ls->active[j];
+            if (ls->ticks_executed[i] < ls->ticks_to_run[i]) {
+                ls->active[num_left++] = i;
+            }
+        }
+        num_active = num_left;
+    }
+    for (int i = 0; i < ls->num_sys; i++) {
+        zx_t* sys = ls->sys[i];
+        _zx_render(sys, sys->scanline_y);
+        clk_ticks_executed(&sys->clk, ls->ticks_executed[i]);
+        _ZX_STATS_ADD(sys, ticks, ls->ticks_executed[i]);
+        kbd_update(&sys->kbd, micro_seconds);
+    }
+}
+
+#undef _ZX_LS_SCALAR
+#undef _ZX_LS_G8
+#undef _ZX_LS_S8
+#undef _ZX_LS_SZ
+#undef _ZX_LS_SZYXCH
+#undef _ZX_LS_ADD_FLAGS
+#undef _ZX_LS_SUB_FLAGS
+#undef _ZX_LS_CP_FLAGS
+#undef _ZX_LS_KIND
+#undef _ZX_LS_OPS_4
+#undef _ZX_LS_OPS_16
+#undef _ZX_LS_OPS_64
+#endif /* CHIPS_IMPL */